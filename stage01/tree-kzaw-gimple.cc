@@ -19,6 +19,7 @@
 #include "pretty-print.h"
 #include "tree-inline.h"
 #include "intl.h"
+#include "cfgloop.h"
 
 namespace {
 
@@ -50,12 +51,118 @@ public:
 
 };
 
+// Per-function histogram for the profiling mode, -fdump-tree-kzaw-stats.
+// Counts are gathered in one walk and printed as a single line, so the
+// dump stays small enough to keep for every function of a large build.
+struct kzaw_profile
+{
+  unsigned blocks;
+  unsigned stmts;
+  unsigned loops;
+  unsigned max_loop_depth;
+  unsigned loads;
+  unsigned stores;
+  unsigned vector_ops;
+  unsigned codes[LAST_AND_UNUSED_GIMPLE_CODE];
+  unsigned rhs_codes[MAX_TREE_CODES];
+};
+
+// Return true if STMT computes or moves a vector value
+static bool
+vector_stmt_p (gimple *stmt)
+{
+  tree lhs = gimple_get_lhs (stmt);
+  if (lhs && VECTOR_TYPE_P (TREE_TYPE (lhs)))
+    return true;
+  for (unsigned i = 0; i < gimple_num_ops (stmt); i++)
+    {
+      tree op = gimple_op (stmt, i);
+      if (op && TREE_TYPE (op) && VECTOR_TYPE_P (TREE_TYPE (op)))
+        return true;
+    }
+  return false;
+}
+
+// Add statement G to PROFILE
+static void
+profile_stmt (kzaw_profile *profile, gimple *g)
+{
+  profile->stmts++;
+  profile->codes[gimple_code (g)]++;
+  if (is_gimple_assign (g))
+    profile->rhs_codes[gimple_assign_rhs_code (g)]++;
+  if (gimple_store_p (g))
+    profile->stores++;
+  if (gimple_assign_load_p (g))
+    profile->loads++;
+  if (vector_stmt_p (g))
+    profile->vector_ops++;
+}
+
+// Print PROFILE of FUN as one record:
+//   PROFILE <name> blocks=N stmts=N loops=N depth=N loads=N stores=N
+//     vector=N codes=<code>:N,... rhs=<code>:N,...
+// with only the codes that occur
+static void
+print_profile (FILE *file, function *fun, const kzaw_profile *profile)
+{
+  fprintf (file, "PROFILE %s blocks=%u stmts=%u loops=%u depth=%u "
+           "loads=%u stores=%u vector=%u codes=",
+           function_name (fun), profile->blocks, profile->stmts,
+           profile->loops, profile->max_loop_depth, profile->loads,
+           profile->stores, profile->vector_ops);
+
+  const char *sep = "";
+  for (unsigned i = 0; i < LAST_AND_UNUSED_GIMPLE_CODE; i++)
+    if (profile->codes[i])
+      {
+        fprintf (file, "%s%s:%u", sep, gimple_code_name[i], profile->codes[i]);
+        sep = ",";
+      }
+
+  fprintf (file, " rhs=");
+  sep = "";
+  for (unsigned i = 0; i < MAX_TREE_CODES; i++)
+    if (profile->rhs_codes[i])
+      {
+        fprintf (file, "%s%s:%u", sep, get_tree_code_name ((enum tree_code) i),
+                 profile->rhs_codes[i]);
+        sep = ",";
+      }
+  fprintf (file, "\n");
+}
+
 unsigned int
 pass_kzaw::execute (function *fun)
 {
   basic_block block;
   int block_count = 0, statement_count = 0;
 
+  // Profiling mode: histograms only, no per-statement output
+  if (dump_file && (dump_flags & TDF_STATS))
+    {
+      kzaw_profile profile;
+      memset (&profile, 0, sizeof (profile));
+
+      FOR_EACH_BB_FN (block, fun)
+        {
+          profile.blocks++;
+          for (gimple_stmt_iterator gsi = gsi_start_bb (block); !gsi_end_p (gsi); gsi_next (&gsi))
+            profile_stmt (&profile, gsi_stmt (gsi));
+        }
+
+      if (loops_for_fn (fun))
+        for (auto loop : loops_list (fun, 0))
+          {
+            profile.loops++;
+            profile.max_loop_depth = MAX (profile.max_loop_depth,
+                                          (unsigned) loop_depth (loop));
+          }
+
+      print_profile (dump_file, fun, &profile);
+      return 0;
+    }
+
   // Traverse basic blocks in the current function
   FOR_EACH_BB_FN (block, fun)
   {
@@ -0,0 +1,203 @@
+// Startup cost of target_clones groups.
+// Every group adds a relocation that runs its ifunc resolver at load time.
+// For each function count N given on the command line, this runs the
+// startup-<build>-N executables and measures the time from spawning them to
+// main, and the time to dlopen the matching startup-<build>-N.so, for
+// builds without clones ("none"), with the prune and noprune clone targets
+// of the Makefile, and with the noprune clones resolved through shared
+// selectors ("shared").  Costs are also shown per group over "none".
+//
+// Usage: bench-startup [--runs=R] N...
+// Environment: KZAW_BENCH_CPU (core to pin to, default: the current one)
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WARMUP_RUNS 3
+#define DEFAULT_RUNS 21
+#define MAX_RUNS 1001
+
+extern char **environ;
+
+// Builds made by the Makefile for every count: startup-<build>-<N>[.so]
+static const char *const builds[] = { "none", "prune", "noprune", "shared" };
+#define NUM_BUILDS (sizeof(builds) / sizeof(builds[0]))
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// Nanoseconds from spawning PATH to the start of its main, which prints
+// its CLOCK_MONOTONIC time on stdout.  Returns a negative value on failure.
+static double
+time_exec(const char *path)
+{
+  int fds[2];
+  if (pipe(fds) != 0)
+    return -1;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addclose(&actions, fds[0]);
+
+  char *argv[] = { (char *) path, NULL };
+  pid_t pid;
+  double start = now_ns();
+  int err = posix_spawn(&pid, path, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+  if (err) {
+    close(fds[0]);
+    return -1;
+  }
+
+  char buf[64];
+  ssize_t len = read(fds[0], buf, sizeof(buf) - 1);
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  if (len <= 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return -1;
+
+  buf[len] = '\0';
+  return atof(buf) - start;
+}
+
+// Nanoseconds to dlopen PATH with every relocation processed.  Returns a
+// negative value on failure.
+static double
+time_dlopen(const char *path)
+{
+  double start = now_ns();
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  double end = now_ns();
+
+  if (!handle) {
+    fprintf(stderr, "%s\n", dlerror());
+    return -1;
+  }
+  dlclose(handle);
+  return end - start;
+}
+
+// Median of RUNS timings of PATH after warming up, or -1 if any run failed
+static double
+measure(double (*timer)(const char *), const char *path, int runs)
+{
+  static double times[MAX_RUNS];
+
+  for (int i = 0; i < WARMUP_RUNS; i++)
+    if (timer(path) < 0)
+      return -1;
+  for (int i = 0; i < runs; i++)
+    if ((times[i] = timer(path)) < 0)
+      return -1;
+
+  qsort(times, runs, sizeof(double), compare_doubles);
+  return times[runs / 2];
+}
+
+// Pin to KZAW_BENCH_CPU, or to the current core, so spawned children and
+// the loader run where the timing does
+static void
+pin_to_cpu(void)
+{
+  const char *env = getenv("KZAW_BENCH_CPU");
+  int cpu = env ? atoi(env) : sched_getcpu();
+  cpu_set_t set;
+
+  if (cpu < 0)
+    return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    perror("sched_setaffinity");
+}
+
+int
+main(int argc, char **argv)
+{
+  int runs = DEFAULT_RUNS;
+  int first_count = argc;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--runs=", 7) == 0)
+      runs = atoi(argv[i] + 7);
+    else {
+      first_count = i;
+      break;
+    }
+  }
+  if (runs < 1)
+    runs = 1;
+  if (runs > MAX_RUNS)
+    runs = MAX_RUNS;
+  if (first_count == argc) {
+    fprintf(stderr, "usage: %s [--runs=R] N...\n", argv[0]);
+    return 1;
+  }
+
+  pin_to_cpu();
+
+  printf("%8s %-8s %14s %14s %16s %16s\n", "groups", "build", "exec (us)",
+         "dlopen (us)", "exec/group (ns)", "dlopen/group (ns)");
+
+  for (int i = first_count; i < argc; i++) {
+    long count = atol(argv[i]);
+    double base_exec = -1, base_dlopen = -1;
+
+    for (unsigned b = 0; b < NUM_BUILDS; b++) {
+      char exe[256], lib[256];
+      snprintf(exe, sizeof(exe), "./startup-%s-%ld", builds[b], count);
+      snprintf(lib, sizeof(lib), "./startup-%s-%ld.so", builds[b], count);
+
+      double exec_ns = measure(time_exec, exe, runs);
+      double dlopen_ns = measure(time_dlopen, lib, runs);
+      if (exec_ns < 0 || dlopen_ns < 0) {
+        printf("%8ld %-8s %14s %14s (missing or failed)\n",
+               count, builds[b], "-", "-");
+        continue;
+      }
+
+      // The build without clones is the reference for the per-group cost
+      if (b == 0) {
+        base_exec = exec_ns;
+        base_dlopen = dlopen_ns;
+        printf("%8ld %-8s %14.1f %14.1f %16s %16s\n", count, builds[b],
+               exec_ns / 1e3, dlopen_ns / 1e3, "-", "-");
+        continue;
+      }
+
+      char exec_group[32] = "-", dlopen_group[32] = "-";
+      if (base_exec >= 0 && count > 0) {
+        snprintf(exec_group, sizeof(exec_group), "%.1f",
+                 (exec_ns - base_exec) / count);
+        snprintf(dlopen_group, sizeof(dlopen_group), "%.1f",
+                 (dlopen_ns - base_dlopen) / count);
+      }
+      printf("%8ld %-8s %14.1f %14.1f %16s %16s\n", count, builds[b],
+             exec_ns / 1e3, dlopen_ns / 1e3, exec_group, dlopen_group);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,587 @@
+// Per-variant throughput check for the kzaw pruning decisions.
+//
+// Each kernel source (test1.c, clone-test-core.c) is built once per variant
+// as a shared object, with CLONE_ATTRIBUTE set to that variant's target
+// attribute (see the bench targets in the Makefile).  This program loads
+// every object the host can run, times each kernel on fixed inputs pinned
+// to one core, and compares the speedup over the default with the PRUNE and
+// NOPRUNE lines found in the kzaw dump files named on the command line.
+//
+// With --sweep, the array kernels are instead run over working sets from
+// L1-resident to several times the last-level cache, on one thread and on
+// --threads=N threads, and every variant whose advantage over the default
+// is gone at --production-size=BYTES (default: the largest size) is flagged.
+//
+// Usage: bench-variants [--sweep] [--threads=N] [--production-size=BYTES]
+//                       [file.kzaw ...]
+// Environment: KZAW_BENCH_CPU (core to pin to, default: the current one),
+//              KZAW_BENCH_THRESHOLD (speedup that counts as faster, default 1.05)
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+#define WARMUP_RUNS 3
+#define TIMED_RUNS 15
+#define ARRAY_SIZE (1 << 16)
+#define ADD_CALLS 1000000
+
+// Sweep: smallest working set, and how far past the last-level cache to go
+#define SWEEP_MIN_BYTES (4 << 10)
+#define SWEEP_LLC_FACTOR 8
+#define SWEEP_BYTES_PER_RUN (256 << 20)
+#define SWEEP_RUNS 5
+#define SWEEP_MAX_SIZES 32
+#define SWEEP_MAX_THREADS 64
+
+// Variants built by the Makefile: file suffix, target_clones name, host check
+#if defined(__x86_64__)
+#define VARIANTS(X) \
+  X("default", "default", 1) \
+  X("popcnt", "popcnt", __builtin_cpu_supports("popcnt")) \
+  X("arch_x86_64_v3", "arch=x86-64-v3", __builtin_cpu_supports("x86-64-v3"))
+#elif defined(__aarch64__)
+#define VARIANTS(X) \
+  X("default", "default", 1) \
+  X("rng", "rng", (getauxval(AT_HWCAP2) & HWCAP2_RNG) != 0) \
+  X("sve2", "sve2", (getauxval(AT_HWCAP2) & HWCAP2_SVE2) != 0)
+#else
+#error "bench-variants supports x86-64 and AArch64 only"
+#endif
+
+struct variant {
+  const char *suffix;    // Shared object suffix and clone name suffix
+  const char *target;    // As written in target_clones
+  int supported;         // Host can run this variant
+};
+
+// Kernels under test.  scale_samples is the CLONE_ATTRIBUTE function of
+// clone-test-core.c (the volume-scaling core).
+enum kernel { ADD_NUMBERS, PROCESS_ARRAY, SCALE_SAMPLES, NUM_KERNELS };
+
+static const char *const kernel_names[NUM_KERNELS] = {
+  "add_numbers", "process_array", "scale_samples"
+};
+
+// Object each kernel is loaded from: bench-<source>-<suffix>.so
+static const char *const kernel_sources[NUM_KERNELS] = {
+  "test1", "test1", "core"
+};
+
+typedef int (*add_numbers_fn)(int, int);
+typedef void (*process_array_fn)(int *, int);
+typedef void (*scale_samples_fn)(int16_t *, int16_t *, int, int);
+
+// Decisions read from the dump files
+#define MAX_DECISIONS 256
+static struct {
+  char name[128];        // base.suffix, without any trailing clone number
+  int prune;
+} decisions[MAX_DECISIONS];
+static int num_decisions;
+
+static int int_input[ARRAY_SIZE], int_work[ARRAY_SIZE];
+static int16_t sample_input[ARRAY_SIZE], sample_output[ARRAY_SIZE];
+static volatile int sink;
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// Time one run of kernel K from FN, in nanoseconds per call
+static double
+time_run(enum kernel k, void *fn)
+{
+  double start, end;
+
+  switch (k) {
+  case ADD_NUMBERS: {
+    add_numbers_fn add = (add_numbers_fn) fn;
+    int acc = 0;
+    start = now_ns();
+    for (int i = 0; i < ADD_CALLS; i++)
+      acc += add(i & 127, (i >> 7) & 127);
+    end = now_ns();
+    sink = acc;
+    return (end - start) / ADD_CALLS;
+  }
+  case PROCESS_ARRAY:
+    // The kernel works in place, so restore the input outside the timing
+    memcpy(int_work, int_input, sizeof(int_work));
+    start = now_ns();
+    ((process_array_fn) fn)(int_work, ARRAY_SIZE);
+    end = now_ns();
+    sink = int_work[ARRAY_SIZE - 1];
+    return end - start;
+  case SCALE_SAMPLES:
+    start = now_ns();
+    ((scale_samples_fn) fn)(sample_input, sample_output, ARRAY_SIZE, 75);
+    end = now_ns();
+    sink = sample_output[ARRAY_SIZE - 1];
+    return end - start;
+  default:
+    abort();
+  }
+}
+
+// Median time per call over the timed runs, after warming up
+static double
+measure(enum kernel k, void *fn)
+{
+  double runs[TIMED_RUNS];
+
+  for (int i = 0; i < WARMUP_RUNS; i++)
+    time_run(k, fn);
+  for (int i = 0; i < TIMED_RUNS; i++)
+    runs[i] = time_run(k, fn);
+
+  qsort(runs, TIMED_RUNS, sizeof(double), compare_doubles);
+  return runs[TIMED_RUNS / 2];
+}
+
+// Reduce a clone name suffix to the form used by the shared objects:
+// drop an AArch64 "_M" prefix and a trailing ".N" clone number
+static void
+normalize_name(char *name)
+{
+  char *dot = strchr(name, '.');
+  if (!dot)
+    return;
+
+  if (strncmp(dot + 1, "_M", 2) == 0)
+    memmove(dot + 1, dot + 3, strlen(dot + 3) + 1);
+
+  char *last = strrchr(name, '.');
+  if (last != dot && strspn(last + 1, "0123456789") == strlen(last + 1))
+    *last = '\0';
+}
+
+// Collect "PRUNE: base.variant" and "NOPRUNE: base.variant" lines
+static void
+read_decisions(const char *path)
+{
+  FILE *in = fopen(path, "r");
+  char line[512], name[128];
+
+  if (!in) {
+    perror(path);
+    return;
+  }
+
+  while (fgets(line, sizeof(line), in)) {
+    int prune;
+    if (sscanf(line, "PRUNE: %127s", name) == 1)
+      prune = 1;
+    else if (sscanf(line, "NOPRUNE: %127s", name) == 1)
+      prune = 0;
+    else
+      continue;
+
+    // Group-level lines have no variant
+    if (!strchr(name, '.') || num_decisions == MAX_DECISIONS)
+      continue;
+
+    normalize_name(name);
+    strcpy(decisions[num_decisions].name, name);
+    decisions[num_decisions].prune = prune;
+    num_decisions++;
+  }
+
+  fclose(in);
+}
+
+// Decision for KERNEL.SUFFIX: 1 prune, 0 keep, -1 unknown
+static int
+find_decision(const char *kernel, const char *suffix)
+{
+  char name[128];
+  snprintf(name, sizeof(name), "%s.%s", kernel, suffix);
+
+  for (int i = num_decisions - 1; i >= 0; i--)
+    if (strcmp(decisions[i].name, name) == 0)
+      return decisions[i].prune;
+  return -1;
+}
+
+static int
+pin_to_cpu(void)
+{
+  const char *env = getenv("KZAW_BENCH_CPU");
+  int cpu = env ? atoi(env) : sched_getcpu();
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    fprintf(stderr, "Could not pin to CPU %d\n", cpu);
+  else
+    printf("Pinned to CPU %d\n", cpu);
+  return cpu;
+}
+
+// Load kernel K of variant V, or return NULL if it was not built
+static void *
+load_kernel(enum kernel k, const struct variant *v, void **handle)
+{
+  char path[256];
+
+  snprintf(path, sizeof(path), "./bench-%s-%s.so", kernel_sources[k], v->suffix);
+  *handle = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
+  void *fn = *handle ? dlsym(*handle, kernel_names[k]) : NULL;
+  if (!fn && *handle) {
+    dlclose(*handle);
+    *handle = NULL;
+  }
+  return fn;
+}
+
+// Fixed-input comparison of every variant with the pass's decisions
+static void
+run_fixed(const struct variant *variants, int num_variants, double threshold)
+{
+  int mismatches = 0;
+
+  // Fixed inputs, the same for every variant
+  srand(1);
+  for (int i = 0; i < ARRAY_SIZE; i++) {
+    int_input[i] = rand() % 1000;
+    sample_input[i] = (int16_t) (rand() - RAND_MAX / 2);
+  }
+
+  printf("%-14s %-16s %12s %8s %-8s %s\n",
+         "kernel", "variant", "ns/call", "speedup", "decision", "verdict");
+
+  for (int k = 0; k < NUM_KERNELS; k++) {
+    double base_ns = 0;
+
+    for (int v = 0; v < num_variants; v++) {
+      const char *verdict = "";
+      void *handle;
+
+      if (!variants[v].supported) {
+        printf("%-14s %-16s %12s\n", kernel_names[k], variants[v].target,
+               "unsupported");
+        continue;
+      }
+
+      void *fn = load_kernel((enum kernel) k, &variants[v], &handle);
+      if (!fn) {
+        printf("%-14s %-16s %12s\n", kernel_names[k], variants[v].target,
+               "not built");
+        continue;
+      }
+
+      double ns = measure((enum kernel) k, fn);
+      dlclose(handle);
+
+      if (v == 0) {
+        base_ns = ns;
+        printf("%-14s %-16s %12.2f\n", kernel_names[k], variants[v].target, ns);
+        continue;
+      }
+
+      double speedup = base_ns > 0 ? base_ns / ns : 0;
+      int prune = find_decision(kernel_names[k], variants[v].suffix);
+
+      if (prune == 0 && speedup < threshold) {
+        verdict = "kept, not faster";
+        mismatches++;
+      } else if (prune == 1 && speedup >= threshold) {
+        verdict = "pruned, but faster";
+        mismatches++;
+      }
+
+      printf("%-14s %-16s %12.2f %7.2fx %-8s %s\n", kernel_names[k],
+             variants[v].target, ns, speedup,
+             prune < 0 ? "-" : prune ? "PRUNE" : "NOPRUNE", verdict);
+    }
+  }
+
+  printf("%d decision(s) disagree with measurement (threshold %.2fx)\n",
+         mismatches, threshold);
+}
+
+// Size of the last-level cache in bytes, or a generous guess
+static long
+llc_bytes(void)
+{
+  long size = 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (size <= 0)
+    size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+  return size > 0 ? size : 32L << 20;
+}
+
+// One sweep worker: runs kernel K over its share of the working set
+struct sweep_worker {
+  pthread_t thread;
+  enum kernel k;
+  void *fn;
+  long bytes;              // Working set: input plus output
+  long runs;               // Kernel calls per measurement
+  pthread_barrier_t *start;
+  void *in, *out;
+  double seconds;
+};
+
+static void *
+sweep_worker_main(void *arg)
+{
+  struct sweep_worker *w = arg;
+  long count = w->bytes / 2 / (w->k == PROCESS_ARRAY ? sizeof(int) : sizeof(int16_t));
+
+  // Touch the buffers before timing so page faults are not measured
+  if (w->k == PROCESS_ARRAY)
+    ((process_array_fn) w->fn)(w->in, count);
+  else
+    ((scale_samples_fn) w->fn)(w->in, w->out, count, 75);
+
+  pthread_barrier_wait(w->start);
+  double start = now_ns();
+  for (long r = 0; r < w->runs; r++) {
+    // process_array works in place; its values settle but the work does not shrink
+    if (w->k == PROCESS_ARRAY)
+      ((process_array_fn) w->fn)(w->in, count);
+    else
+      ((scale_samples_fn) w->fn)(w->in, w->out, count, 75);
+  }
+  w->seconds = (now_ns() - start) / 1e9;
+  return NULL;
+}
+
+// Throughput in GB/s of working set for kernel K over a BYTES-sized working
+// set split evenly across THREADS threads, one per core from FIRST_CPU on
+static double
+sweep_throughput(enum kernel k, void *fn, long total_bytes, int threads, int first_cpu)
+{
+  struct sweep_worker workers[SWEEP_MAX_THREADS];
+  pthread_barrier_t start;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long bytes = total_bytes / threads / 256 * 256;
+  long runs = SWEEP_BYTES_PER_RUN / total_bytes;
+  double best = 0;
+
+  if (bytes < 256)
+    bytes = 256;
+  if (runs < 1)
+    runs = 1;
+
+  for (int t = 0; t < threads; t++) {
+    workers[t].in = malloc(bytes / 2);
+    workers[t].out = malloc(bytes / 2);
+    if (!workers[t].in || !workers[t].out) {
+      perror("malloc");
+      exit(1);
+    }
+    // Fixed input: the sample generator's range for int16_t, small ints otherwise
+    srand(t + 1);
+    if (k == PROCESS_ARRAY)
+      for (long i = 0; i < bytes / 2 / (long) sizeof(int); i++)
+        ((int *) workers[t].in)[i] = rand() % 1000;
+    else
+      for (long i = 0; i < bytes / 2 / (long) sizeof(int16_t); i++)
+        ((int16_t *) workers[t].in)[i] = (int16_t) (rand() - RAND_MAX / 2);
+  }
+
+  // Best of SWEEP_RUNS, each timed by its slowest thread
+  for (int run = 0; run < SWEEP_RUNS; run++) {
+    double slowest = 0;
+
+    pthread_barrier_init(&start, NULL, threads);
+    for (int t = 0; t < threads; t++) {
+      workers[t].k = k;
+      workers[t].fn = fn;
+      workers[t].bytes = bytes;
+      workers[t].runs = runs;
+      workers[t].start = &start;
+
+      // One core per thread, starting with the one the program is pinned to
+      pthread_attr_t attr;
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET((first_cpu + t) % cpus, &set);
+      pthread_attr_init(&attr);
+      pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+      pthread_create(&workers[t].thread, &attr, sweep_worker_main, &workers[t]);
+      pthread_attr_destroy(&attr);
+    }
+    for (int t = 0; t < threads; t++) {
+      pthread_join(workers[t].thread, NULL);
+      if (workers[t].seconds > slowest)
+        slowest = workers[t].seconds;
+    }
+    pthread_barrier_destroy(&start);
+
+    double gbps = (double) bytes * runs * threads / slowest / 1e9;
+    if (gbps > best)
+      best = gbps;
+  }
+
+  for (int t = 0; t < threads; t++) {
+    free(workers[t].in);
+    free(workers[t].out);
+  }
+  return best;
+}
+
+static void
+format_size(char *buf, size_t len, long bytes)
+{
+  if (bytes >= 1L << 20)
+    snprintf(buf, len, "%ld MiB", bytes >> 20);
+  else
+    snprintf(buf, len, "%ld KiB", bytes >> 10);
+}
+
+// Working-set sweep of the array kernels, single- and multi-threaded
+static void
+run_sweep(const struct variant *variants, int num_variants, double threshold,
+          int threads, long production_bytes, int first_cpu)
+{
+  long sizes[SWEEP_MAX_SIZES];
+  int num_sizes = 0;
+  long llc = llc_bytes();
+  char buf[32];
+  int flagged = 0;
+
+  for (long bytes = SWEEP_MIN_BYTES;
+       bytes <= llc * SWEEP_LLC_FACTOR && num_sizes < SWEEP_MAX_SIZES; bytes *= 2)
+    sizes[num_sizes++] = bytes;
+  if (production_bytes <= 0)
+    production_bytes = sizes[num_sizes - 1];
+
+  // Largest swept size not above the production size
+  int prod = 0;
+  while (prod + 1 < num_sizes && sizes[prod + 1] <= production_bytes)
+    prod++;
+
+  format_size(buf, sizeof(buf), llc);
+  printf("Last-level cache %s, %d thread(s) for the multi-threaded runs\n",
+         buf, threads);
+  printf("%-14s %-16s %10s %10s %8s %10s %8s\n", "kernel", "variant", "size",
+         "GB/s 1T", "speedup", "GB/s NT", "speedup");
+
+  for (int k = PROCESS_ARRAY; k <= SCALE_SAMPLES; k++) {
+    double base[2][SWEEP_MAX_SIZES];
+    int have_base = 0;
+
+    for (int v = 0; v < num_variants; v++) {
+      double speedup[2][SWEEP_MAX_SIZES];
+      void *handle;
+
+      if (!variants[v].supported)
+        continue;
+      void *fn = load_kernel((enum kernel) k, &variants[v], &handle);
+      if (!fn)
+        continue;
+      if (v != 0 && !have_base) {
+        dlclose(handle);
+        continue;
+      }
+
+      for (int s = 0; s < num_sizes; s++) {
+        double single = sweep_throughput((enum kernel) k, fn, sizes[s], 1, first_cpu);
+        double multi = sweep_throughput((enum kernel) k, fn, sizes[s], threads, first_cpu);
+
+        format_size(buf, sizeof(buf), sizes[s]);
+        if (v == 0) {
+          base[0][s] = single;
+          base[1][s] = multi;
+          printf("%-14s %-16s %10s %10.2f %8s %10.2f\n", kernel_names[k],
+                 variants[v].target, buf, single, "", multi);
+          continue;
+        }
+
+        speedup[0][s] = single / base[0][s];
+        speedup[1][s] = multi / base[1][s];
+        printf("%-14s %-16s %10s %10.2f %7.2fx %10.2f %7.2fx\n", kernel_names[k],
+               variants[v].target, buf, single, speedup[0][s], multi,
+               speedup[1][s]);
+      }
+      dlclose(handle);
+
+      if (v == 0) {
+        have_base = 1;
+        continue;
+      }
+
+      // Faster when cache-resident, but not at the production size
+      for (int m = 0; m < 2; m++) {
+        if (speedup[m][0] >= threshold && speedup[m][prod] < threshold) {
+          char prod_buf[32];
+          format_size(buf, sizeof(buf), sizes[0]);
+          format_size(prod_buf, sizeof(prod_buf), sizes[prod]);
+          printf("FLAG: %s %s: %.2fx at %s but %.2fx at %s (%d thread(s))\n",
+                 kernel_names[k], variants[v].target, speedup[m][0], buf,
+                 speedup[m][prod], prod_buf, m ? threads : 1);
+          flagged++;
+        }
+      }
+    }
+  }
+
+  printf("%d clone(s) lose their advantage at production size (threshold %.2fx)\n",
+         flagged, threshold);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct variant variants[] = {
+#define VARIANT_ENTRY(suffix, target, check) { suffix, target, check },
+    VARIANTS(VARIANT_ENTRY)
+#undef VARIANT_ENTRY
+  };
+  const int num_variants = sizeof(variants) / sizeof(variants[0]);
+  const char *env = getenv("KZAW_BENCH_THRESHOLD");
+  double threshold = env ? atof(env) : 1.05;
+  int sweep = 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long production_bytes = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--sweep") == 0)
+      sweep = 1;
+    else if (strncmp(argv[i], "--threads=", 10) == 0)
+      threads = atoi(argv[i] + 10);
+    else if (strncmp(argv[i], "--production-size=", 18) == 0)
+      production_bytes = atol(argv[i] + 18);
+    else
+      read_decisions(argv[i]);
+  }
+  if (threads < 1)
+    threads = 1;
+  if (threads > SWEEP_MAX_THREADS)
+    threads = SWEEP_MAX_THREADS;
+
+  int cpu = pin_to_cpu();
+
+  if (sweep)
+    run_sweep(variants, num_variants, threshold, threads, production_bytes, cpu);
+  else
+    run_fixed(variants, num_variants, threshold);
+  return 0;
+}
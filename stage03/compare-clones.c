@@ -0,0 +1,671 @@
+// Machine-code comparison of target_clones variants in built binaries.
+//
+// GIMPLE equality, which the kzaw pass decides on, says little about the
+// code that is finally emitted.  This program maps each ELF file named on
+// the command line (the clone-test binaries of the Makefile, or any other
+// 64-bit x86-64 or AArch64 object, executable or shared object) and finds
+// its version groups in the symbol table: a base name that has an ifunc
+// symbol or a <base>.resolver function, with variants named
+// <base>.<variant>[.N].  Each variant is compared with the group's default:
+//  - relocations, in objects or in binaries linked with --emit-relocs,
+//    match when they have the same type and target;
+//  - in linked code, PC-relative operands match when they reach the same
+//    address, though the variants sit at different addresses: rel32 fields
+//    on x86-64, branches, literal loads, ADR and ADRP on AArch64;
+//  - bodies of different lengths are aligned at their start and at their
+//    end, and the better alignment is kept.
+// A variant is identical when every byte matches, near-identical when at
+// least --near=PCT percent of the bytes of the longer body match (default
+// 95), and distinct otherwise.  Given kzaw dump files (*.kzaw), each
+// variant is also checked against the pass's PRUNE or NOPRUNE decision.
+//
+// Usage: compare-clones [--near=PCT] file... [file.kzaw ...]
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEFAULT_NEAR_PERCENT 95
+#define MAX_DECISIONS 4096
+#define MAX_VARIANTS 32
+
+// Per-byte state set by relocations before the bytes are compared
+#define BYTE_COMPARE 0
+#define BYTE_MATCH 1
+#define BYTE_MISMATCH 2
+
+// What a relocation refers to: an undefined symbol by name, or an address
+// within a section
+struct reloc_target {
+  const char *name;
+  unsigned shndx;
+  uint64_t value;
+};
+
+struct reloc {
+  unsigned shndx;       // Section the relocation applies to
+  uint64_t offset;      // Same units as symbol values
+  uint32_t type;
+  struct reloc_target target;
+};
+
+struct function {
+  const char *name;
+  unsigned shndx;
+  uint64_t addr;        // Symbol value
+  uint64_t size;
+  const unsigned char *bytes;
+};
+
+struct elf_file {
+  const char *path;
+  const unsigned char *map;
+  size_t map_size;
+  unsigned machine;
+  int linked;           // Executable or shared object, not a relocatable object
+  struct function *functions;   // Sorted by name
+  size_t num_functions;
+  const char **bases;           // Sorted, unique group base names
+  size_t num_bases;
+  struct reloc *relocs;         // Sorted by section, then offset
+  size_t num_relocs;
+};
+
+struct variant {
+  char name[128];       // Normalized, as in the kzaw dumps: no _M, no .N
+  const struct function *fn;
+};
+
+struct decision {
+  char base[128];
+  char variant[128];    // Normalized like struct variant
+  int prune;
+};
+
+static struct decision decisions[MAX_DECISIONS];
+static int num_decisions;
+
+// Totals over every file
+static unsigned total_identical, total_near, total_distinct, total_disagree;
+
+static uint32_t
+read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int
+compare_functions(const void *a, const void *b)
+{
+  return strcmp(((const struct function *) a)->name,
+                ((const struct function *) b)->name);
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+  return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+static int
+compare_relocs(const void *a, const void *b)
+{
+  const struct reloc *x = a, *y = b;
+  if (x->shndx != y->shndx)
+    return x->shndx < y->shndx ? -1 : 1;
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Reduce a variant name to the form the kzaw dumps use: drop an AArch64
+// "_M" prefix and a trailing ".N" clone number.  Returns 0 for names that
+// are not a plain variant, such as a .cold partition or the resolver.
+static int
+normalize_variant(const char *rest, char *out, size_t size)
+{
+  if (strncmp(rest, "_M", 2) == 0)
+    rest += 2;
+  snprintf(out, size, "%s", rest);
+
+  char *dot = strchr(out, '.');
+  if (dot) {
+    if (!dot[1] || strspn(dot + 1, "0123456789") != strlen(dot + 1))
+      return 0;
+    *dot = '\0';
+  }
+  return *out && strcmp(out, "resolver") != 0;
+}
+
+// Bytes covered by a relocation of TYPE
+static unsigned
+reloc_size(unsigned machine, uint32_t type)
+{
+  if (machine == EM_X86_64)
+    return type == R_X86_64_64 || type == R_X86_64_PC64 ? 8 : 4;
+  if (machine == EM_AARCH64)
+    return type == R_AARCH64_ABS64 || type == R_AARCH64_PREL64 ? 8 : 4;
+  return 4;
+}
+
+static int
+same_target(const struct reloc *a, const struct reloc *b)
+{
+  if (a->type != b->type)
+    return 0;
+  if (a->target.name || b->target.name)
+    return a->target.name && b->target.name
+           && strcmp(a->target.name, b->target.name) == 0
+           && a->target.value == b->target.value;
+  return a->target.shndx == b->target.shndx && a->target.value == b->target.value;
+}
+
+// Map PATH and collect its functions, group bases and text relocations.
+// Returns 0 if PATH is not a 64-bit little-endian ELF file.
+static int
+load_elf(const char *path, struct elf_file *elf)
+{
+  memset(elf, 0, sizeof(*elf));
+  elf->path = path;
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return 0;
+  }
+  if ((size_t) st.st_size < sizeof(Elf64_Ehdr)) {
+    fprintf(stderr, "%s: not an ELF file\n", path);
+    close(fd);
+    return 0;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return 0;
+  }
+  elf->map = map;
+  elf->map_size = st.st_size;
+
+  const Elf64_Ehdr *ehdr = map;
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+      || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+      || ehdr->e_ident[EI_DATA] != ELFDATA2LSB
+      || ehdr->e_shoff == 0
+      || ehdr->e_shentsize != sizeof(Elf64_Shdr)
+      || ehdr->e_shoff + (uint64_t) ehdr->e_shnum * sizeof(Elf64_Shdr) > elf->map_size) {
+    fprintf(stderr, "%s: not a 64-bit little-endian ELF file\n", path);
+    return 0;
+  }
+  elf->machine = ehdr->e_machine;
+  elf->linked = ehdr->e_type != ET_REL;
+
+  const Elf64_Shdr *shdrs = (const Elf64_Shdr *) (elf->map + ehdr->e_shoff);
+  unsigned shnum = ehdr->e_shnum;
+
+  // The full symbol table if there is one, else the dynamic one
+  unsigned symtab = 0;
+  for (unsigned i = 1; i < shnum; i++)
+    if (shdrs[i].sh_type == SHT_SYMTAB
+        || (shdrs[i].sh_type == SHT_DYNSYM && !symtab))
+      symtab = i;
+  if (!symtab || shdrs[symtab].sh_link >= shnum) {
+    fprintf(stderr, "%s: no symbol table\n", path);
+    return 0;
+  }
+
+  const Elf64_Shdr *sym_sh = &shdrs[symtab], *str_sh = &shdrs[sym_sh->sh_link];
+  if (sym_sh->sh_offset + sym_sh->sh_size > elf->map_size
+      || str_sh->sh_offset + str_sh->sh_size > elf->map_size) {
+    fprintf(stderr, "%s: truncated symbol table\n", path);
+    return 0;
+  }
+  const Elf64_Sym *syms = (const Elf64_Sym *) (elf->map + sym_sh->sh_offset);
+  size_t num_syms = sym_sh->sh_size / sizeof(Elf64_Sym);
+  const char *strtab = (const char *) (elf->map + str_sh->sh_offset);
+  size_t strtab_size = str_sh->sh_size;
+
+  elf->functions = calloc(num_syms, sizeof(struct function));
+  elf->bases = calloc(num_syms, sizeof(const char *));
+  for (size_t i = 1; i < num_syms; i++) {
+    const Elf64_Sym *sym = &syms[i];
+    unsigned type = ELF64_ST_TYPE(sym->st_info);
+    if ((type != STT_FUNC && type != STT_GNU_IFUNC)
+        || sym->st_shndx == SHN_UNDEF || sym->st_shndx >= shnum
+        || sym->st_name >= strtab_size)
+      continue;
+    const char *name = strtab + sym->st_name;
+
+    // An ifunc symbol, or a resolver, names a group
+    size_t len = strlen(name);
+    if (type == STT_GNU_IFUNC)
+      elf->bases[elf->num_bases++] = strdup(name);
+    else if (len > 9 && strcmp(name + len - 9, ".resolver") == 0)
+      elf->bases[elf->num_bases++] = strndup(name, len - 9);
+
+    const Elf64_Shdr *sh = &shdrs[sym->st_shndx];
+    if (type != STT_FUNC || !sym->st_size || sh->sh_type == SHT_NOBITS
+        || sym->st_value < sh->sh_addr
+        || sym->st_value - sh->sh_addr + sym->st_size > sh->sh_size
+        || sh->sh_offset + sh->sh_size > elf->map_size)
+      continue;
+
+    struct function *fn = &elf->functions[elf->num_functions++];
+    fn->name = name;
+    fn->shndx = sym->st_shndx;
+    fn->addr = sym->st_value;
+    fn->size = sym->st_size;
+    fn->bytes = elf->map + sh->sh_offset + (sym->st_value - sh->sh_addr);
+  }
+  qsort(elf->functions, elf->num_functions, sizeof(struct function),
+        compare_functions);
+
+  // A group usually has both an ifunc symbol and a resolver
+  qsort(elf->bases, elf->num_bases, sizeof(const char *), compare_names);
+  size_t unique = 0;
+  for (size_t i = 0; i < elf->num_bases; i++)
+    if (!unique || strcmp(elf->bases[i], elf->bases[unique - 1]) != 0)
+      elf->bases[unique++] = elf->bases[i];
+    else
+      free((char *) elf->bases[i]);
+  elf->num_bases = unique;
+
+  // Relocations against code that use this symbol table
+  for (unsigned i = 1; i < shnum; i++) {
+    const Elf64_Shdr *sh = &shdrs[i];
+    if (sh->sh_type != SHT_RELA || sh->sh_link != symtab || sh->sh_info >= shnum
+        || !(shdrs[sh->sh_info].sh_flags & SHF_EXECINSTR)
+        || sh->sh_offset + sh->sh_size > elf->map_size)
+      continue;
+
+    const Elf64_Rela *rela = (const Elf64_Rela *) (elf->map + sh->sh_offset);
+    size_t count = sh->sh_size / sizeof(Elf64_Rela);
+    elf->relocs = realloc(elf->relocs, (elf->num_relocs + count) * sizeof(struct reloc));
+    for (size_t r = 0; r < count; r++) {
+      size_t symi = ELF64_R_SYM(rela[r].r_info);
+      if (symi >= num_syms)
+        continue;
+      const Elf64_Sym *sym = &syms[symi];
+      struct reloc *rel = &elf->relocs[elf->num_relocs++];
+      rel->shndx = sh->sh_info;
+      rel->offset = rela[r].r_offset;
+      rel->type = ELF64_R_TYPE(rela[r].r_info);
+      rel->target.name = NULL;
+      rel->target.shndx = sym->st_shndx;
+      rel->target.value = sym->st_value + rela[r].r_addend;
+      if (sym->st_shndx == SHN_UNDEF && sym->st_name < strtab_size) {
+        rel->target.name = strtab + sym->st_name;
+        rel->target.value = rela[r].r_addend;
+      }
+    }
+  }
+  if (elf->num_relocs)
+    qsort(elf->relocs, elf->num_relocs, sizeof(struct reloc), compare_relocs);
+  return 1;
+}
+
+static void
+unload_elf(struct elf_file *elf)
+{
+  for (size_t i = 0; i < elf->num_bases; i++)
+    free((char *) elf->bases[i]);
+  free(elf->bases);
+  free(elf->functions);
+  free(elf->relocs);
+  if (elf->map)
+    munmap((void *) elf->map, elf->map_size);
+}
+
+// Index of the first relocation of ELF at or after OFFSET in section SHNDX
+static size_t
+first_reloc(const struct elf_file *elf, unsigned shndx, uint64_t offset)
+{
+  size_t lo = 0, hi = elf->num_relocs;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const struct reloc *r = &elf->relocs[mid];
+    if (r->shndx < shndx || (r->shndx == shndx && r->offset < offset))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Set STATE for the relocated bytes of the N bytes at A+A_OFF and B+B_OFF:
+// a relocation matches one at the same place in the other with the same
+// type and target, and anything else is a mismatch
+static void
+mark_relocs(const struct elf_file *elf, const struct function *a, uint64_t a_off,
+            const struct function *b, uint64_t b_off, uint64_t n,
+            unsigned char *state)
+{
+  uint64_t a_start = a->addr + a_off, b_start = b->addr + b_off;
+
+  for (size_t i = first_reloc(elf, a->shndx, a_start);
+       i < elf->num_relocs && elf->relocs[i].shndx == a->shndx
+       && elf->relocs[i].offset < a_start + n; i++) {
+    const struct reloc *ra = &elf->relocs[i];
+    uint64_t o = ra->offset - a_start;
+    unsigned len = reloc_size(elf->machine, ra->type);
+    if (o + len > n)
+      len = n - o;
+
+    size_t j = first_reloc(elf, b->shndx, b_start + o);
+    int match = j < elf->num_relocs && elf->relocs[j].shndx == b->shndx
+                && elf->relocs[j].offset == b_start + o
+                && same_target(ra, &elf->relocs[j]);
+    memset(state + o, match ? BYTE_MATCH : BYTE_MISMATCH, len);
+  }
+
+  for (size_t j = first_reloc(elf, b->shndx, b_start);
+       j < elf->num_relocs && elf->relocs[j].shndx == b->shndx
+       && elf->relocs[j].offset < b_start + n; j++) {
+    uint64_t o = elf->relocs[j].offset - b_start;
+    unsigned len = reloc_size(elf->machine, elf->relocs[j].type);
+    if (o + len > n)
+      len = n - o;
+    for (unsigned k = 0; k < len; k++)
+      if (state[o + k] != BYTE_MATCH)
+        state[o + k] = BYTE_MISMATCH;
+  }
+}
+
+// If INSN, at address PC, is an AArch64 PC-relative instruction, store the
+// address it refers to in *TARGET and return the mask of its offset bits
+static uint32_t
+aarch64_pcrel(uint32_t insn, uint64_t pc, uint64_t *target)
+{
+  int64_t imm;
+
+  if ((insn & 0x7c000000) == 0x14000000) {            // B, BL
+    imm = (int64_t) ((uint64_t) (insn & 0x03ffffff) << 38) >> 36;
+    *target = pc + imm;
+    return 0x03ffffff;
+  }
+  if ((insn & 0xff000010) == 0x54000000               // B.cond
+      || (insn & 0x7e000000) == 0x34000000            // CBZ, CBNZ
+      || (insn & 0x3b000000) == 0x18000000) {         // LDR literal
+    imm = (int64_t) ((uint64_t) ((insn >> 5) & 0x7ffff) << 45) >> 43;
+    *target = pc + imm;
+    return 0x00ffffe0;
+  }
+  if ((insn & 0x7e000000) == 0x36000000) {            // TBZ, TBNZ
+    imm = (int64_t) ((uint64_t) ((insn >> 5) & 0x3fff) << 50) >> 48;
+    *target = pc + imm;
+    return 0x0007ffe0;
+  }
+  if ((insn & 0x1f000000) == 0x10000000) {            // ADR, ADRP
+    uint64_t bits = ((uint64_t) ((insn >> 5) & 0x7ffff) << 2) | ((insn >> 29) & 3);
+    imm = (int64_t) (bits << 43) >> 43;
+    if (insn & 0x80000000)
+      *target = (pc & ~(uint64_t) 0xfff) + (imm << 12);
+    else
+      *target = pc + imm;
+    return 0x60ffffe0;
+  }
+  return 0;
+}
+
+// Number of matching bytes among the N bytes at A+A_OFF and B+B_OFF
+static uint64_t
+count_matches(const struct elf_file *elf, const struct function *a, uint64_t a_off,
+              const struct function *b, uint64_t b_off, uint64_t n)
+{
+  const unsigned char *pa = a->bytes + a_off, *pb = b->bytes + b_off;
+  uint64_t a_pc = a->addr + a_off, b_pc = b->addr + b_off;
+  unsigned char *state = calloc(n ? n : 1, 1);
+  uint64_t matches = 0, i = 0;
+
+  if (elf->num_relocs)
+    mark_relocs(elf, a, a_off, b, b_off, n, state);
+
+  // AArch64 code is compared an instruction at a time
+  if (elf->machine == EM_AARCH64 && elf->linked && a_pc % 4 == 0 && b_pc % 4 == 0) {
+    for (; i + 4 <= n; i += 4) {
+      uint32_t ia = read32(pa + i), ib = read32(pb + i);
+      uint64_t ta, tb;
+      uint32_t mask;
+      if (state[i] != BYTE_COMPARE)
+        matches += state[i] == BYTE_MATCH ? 4 : 0;
+      else if (ia == ib)
+        matches += 4;
+      else if ((mask = aarch64_pcrel(ia, a_pc + i, &ta)) != 0
+               && aarch64_pcrel(ib, b_pc + i, &tb) == mask
+               && (ia & ~mask) == (ib & ~mask) && ta == tb)
+        matches += 4;
+    }
+  }
+
+  uint32_t delta = (uint32_t) (b_pc - a_pc);
+  while (i < n) {
+    if (state[i] != BYTE_COMPARE || pa[i] == pb[i]) {
+      matches += state[i] != BYTE_MISMATCH;
+      i++;
+      continue;
+    }
+
+    // A rel32 operand reaching the same address from both variants differs
+    // by exactly the distance between them.  The field may start up to
+    // three bytes before the first differing byte.
+    uint64_t end = 0;
+    if (elf->machine == EM_X86_64 && elf->linked)
+      for (uint64_t j = i >= 3 ? i - 3 : 0; j <= i && j + 4 <= n; j++)
+        if (!state[j] && !state[j + 1] && !state[j + 2] && !state[j + 3]
+            && read32(pa + j) - read32(pb + j) == delta) {
+          end = j + 4;
+          break;
+        }
+    if (end) {
+      matches += end - i;
+      i = end;
+    } else
+      i++;
+  }
+
+  free(state);
+  return matches;
+}
+
+// Percentage of the bytes of the longer of A and B that match, aligning
+// the bodies at their start and at their end
+static double
+similarity(const struct elf_file *elf, const struct function *a,
+           const struct function *b)
+{
+  uint64_t common = a->size < b->size ? a->size : b->size;
+  uint64_t longest = a->size > b->size ? a->size : b->size;
+  uint64_t best = count_matches(elf, a, 0, b, 0, common);
+
+  if (a->size != b->size && best < common) {
+    uint64_t at_end = count_matches(elf, a, a->size - common,
+                                    b, b->size - common, common);
+    if (at_end > best)
+      best = at_end;
+  }
+  return longest ? 100.0 * best / longest : 100.0;
+}
+
+// Collect "PRUNE: base.variant" and "NOPRUNE: base.variant" lines
+static void
+read_decisions(const char *path)
+{
+  FILE *in = fopen(path, "r");
+  char line[512], name[128];
+
+  if (!in) {
+    perror(path);
+    return;
+  }
+
+  while (fgets(line, sizeof(line), in)) {
+    int prune;
+    if (sscanf(line, "PRUNE: %127s", name) == 1)
+      prune = 1;
+    else if (sscanf(line, "NOPRUNE: %127s", name) == 1)
+      prune = 0;
+    else
+      continue;
+
+    // Group-level lines have no variant
+    char *dot = strchr(name, '.');
+    if (!dot || num_decisions == MAX_DECISIONS)
+      continue;
+
+    struct decision *d = &decisions[num_decisions];
+    *dot = '\0';
+    if (!normalize_variant(dot + 1, d->variant, sizeof(d->variant)))
+      continue;
+    strcpy(d->base, name);
+    d->prune = prune;
+    num_decisions++;
+  }
+
+  fclose(in);
+}
+
+// Decision for BASE.VARIANT: 1 prune, 0 keep, -1 unknown
+static int
+find_decision(const char *base, const char *variant)
+{
+  for (int i = num_decisions - 1; i >= 0; i--)
+    if (strcmp(decisions[i].base, base) == 0
+        && strcmp(decisions[i].variant, variant) == 0)
+      return decisions[i].prune;
+  return -1;
+}
+
+// Compare every variant of the group BASE of ELF with its default
+static void
+compare_group(const struct elf_file *elf, const char *base, double near)
+{
+  struct variant variants[MAX_VARIANTS];
+  int num_variants = 0, default_idx = -1;
+  size_t len = strlen(base);
+
+  // Names starting with "base." are contiguous in the sorted functions
+  size_t lo = 0, hi = elf->num_functions;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = strncmp(elf->functions[mid].name, base, len);
+    if (cmp < 0 || (cmp == 0 && elf->functions[mid].name[len] < '.'))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (size_t i = lo; i < elf->num_functions; i++) {
+    const struct function *fn = &elf->functions[i];
+    if (strncmp(fn->name, base, len) != 0 || fn->name[len] != '.')
+      break;
+
+    struct variant *v = &variants[num_variants];
+    if (!normalize_variant(fn->name + len + 1, v->name, sizeof(v->name)))
+      continue;
+
+    // Local functions of different sources may share a name
+    for (int j = 0; j < num_variants; j++)
+      if (strcmp(variants[j].name, v->name) == 0) {
+        printf("%-32s %-20s (ambiguous: more than one %s)\n", base, v->name,
+               fn->name);
+        return;
+      }
+    if (num_variants == MAX_VARIANTS)
+      break;
+    v->fn = fn;
+    if (strcmp(v->name, "default") == 0)
+      default_idx = num_variants;
+    num_variants++;
+  }
+
+  if (default_idx < 0) {
+    printf("%-32s %-20s (no default version)\n", base, "-");
+    return;
+  }
+
+  const struct function *def = variants[default_idx].fn;
+  printf("%-32s %-20s %8lu\n", base, "default", (unsigned long) def->size);
+
+  for (int i = 0; i < num_variants; i++) {
+    if (i == default_idx)
+      continue;
+
+    const struct function *fn = variants[i].fn;
+    double pct = similarity(elf, def, fn);
+    const char *verdict, *check = "";
+    if (pct >= 100.0) {
+      verdict = "identical";
+      total_identical++;
+    } else if (pct >= near) {
+      verdict = "near";
+      total_near++;
+    } else {
+      verdict = "distinct";
+      total_distinct++;
+    }
+
+    int prune = find_decision(base, variants[i].name);
+    if ((prune == 1 && pct < near) || (prune == 0 && pct >= 100.0)) {
+      check = prune ? "pruned, but distinct" : "kept, but identical";
+      total_disagree++;
+    }
+
+    printf("%-32s %-20s %8lu %6.1f%% %-9s %-8s %s\n", base, variants[i].name,
+           (unsigned long) fn->size, pct, verdict,
+           prune < 0 ? "-" : prune ? "PRUNE" : "NOPRUNE", check);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  double near = DEFAULT_NEAR_PERCENT;
+  int num_files = 0;
+
+  for (int i = 1; i < argc; i++) {
+    size_t len = strlen(argv[i]);
+    if (strncmp(argv[i], "--near=", 7) == 0)
+      near = atof(argv[i] + 7);
+    else if (len > 5 && strcmp(argv[i] + len - 5, ".kzaw") == 0)
+      read_decisions(argv[i]);
+    else
+      num_files++;
+  }
+  if (!num_files) {
+    fprintf(stderr, "usage: %s [--near=PCT] file... [file.kzaw ...]\n", argv[0]);
+    return 1;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    size_t len = strlen(argv[i]);
+    if (strncmp(argv[i], "--", 2) == 0
+        || (len > 5 && strcmp(argv[i] + len - 5, ".kzaw") == 0))
+      continue;
+
+    struct elf_file elf;
+    if (load_elf(argv[i], &elf)) {
+      printf("%s: %lu groups, %lu text relocations\n", argv[i],
+             (unsigned long) elf.num_bases, (unsigned long) elf.num_relocs);
+      printf("%-32s %-20s %8s %7s %-9s %-8s %s\n", "function", "variant",
+             "bytes", "match", "verdict", "decision", "check");
+      for (size_t g = 0; g < elf.num_bases; g++)
+        compare_group(&elf, elf.bases[g], near);
+      printf("\n");
+    }
+    unload_elf(&elf);
+  }
+
+  printf("%u identical, %u near-identical (>= %.1f%%), %u distinct; "
+         "%u decision(s) disagree\n",
+         total_identical, total_near, near, total_distinct, total_disagree);
+  return 0;
+}
@@ -0,0 +1,62 @@
+// Runtime for binaries built with -fkzaw-instrument-clones.
+// Link this object in with the instrumented code.  At exit, every counter
+// block is appended to the file named by KZAW_COUNTERS_FILE
+// (kzaw-counters.txt by default) as one line per variant:
+//   <pid> <variant> <selected by resolver> <calls>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "kzaw-counters.h"
+
+typedef uintptr_t kzaw_block[KZAW_COUNTER_WORDS];
+
+// Bounds of the counter section, provided by the linker
+extern kzaw_block __start___kzaw_counters[] __attribute__((weak, visibility("hidden")));
+extern kzaw_block __stop___kzaw_counters[] __attribute__((weak, visibility("hidden")));
+
+static unsigned next_shard;
+static __thread unsigned thread_shard = ~0u;
+
+// Called on entry to every instrumented variant
+void
+__kzaw_clone_enter(uintptr_t *block)
+{
+  // Threads take shards round-robin the first time they get here
+  if (__builtin_expect(thread_shard == ~0u, 0))
+    thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)
+                   % KZAW_COUNTER_SHARDS;
+
+  __atomic_fetch_add(&block[KZAW_COUNTER_SHARD(thread_shard)], 1,
+                     __ATOMIC_RELAXED);
+}
+
+// Append every block to the counters file
+__attribute__((destructor))
+static void
+kzaw_dump_counters(void)
+{
+  kzaw_block *begin = __start___kzaw_counters;
+  kzaw_block *end = __stop___kzaw_counters;
+  if (begin == end)
+    return;
+
+  const char *path = getenv("KZAW_COUNTERS_FILE");
+  FILE *out = fopen(path ? path : "kzaw-counters.txt", "a");
+  if (!out)
+    return;
+
+  for (kzaw_block *b = begin; b < end; b++) {
+    uintptr_t calls = 0;
+    for (unsigned s = 0; s < KZAW_COUNTER_SHARDS; s++)
+      calls += __atomic_load_n(&(*b)[KZAW_COUNTER_SHARD(s)], __ATOMIC_RELAXED);
+
+    fprintf(out, "%ld %s %lu %lu\n", (long) getpid(),
+            (const char *) (*b)[KZAW_COUNTER_NAME],
+            (unsigned long) (*b)[KZAW_COUNTER_SELECTED], (unsigned long) calls);
+  }
+
+  fclose(out);
+}
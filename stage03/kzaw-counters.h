@@ -0,0 +1,30 @@
+// Layout of the per-variant counter blocks emitted by -fkzaw-instrument-clones.
+// Shared by the kzaw pass, which emits the blocks, and kzaw-clone-counters.c,
+// which updates and dumps them.  Every block is an array of pointer-sized words.
+
+#ifndef KZAW_COUNTERS_H
+#define KZAW_COUNTERS_H
+
+// Section holding all blocks, so the runtime can walk them with the
+// linker-provided __start_/__stop_ symbols
+#define KZAW_COUNTER_SECTION "__kzaw_counters"
+
+// Number of call counters per variant; each thread uses one of them
+#define KZAW_COUNTER_SHARDS 8
+
+// Words per cache line, so shards used by different threads never share one
+#define KZAW_COUNTER_STRIDE 8
+
+// Word 0 holds the address of the variant's assembler name
+#define KZAW_COUNTER_NAME 0
+
+// Word 1 is set by the resolver when it picks the variant
+#define KZAW_COUNTER_SELECTED 1
+
+// Word holding the call count of shard S
+#define KZAW_COUNTER_SHARD(s) (((s) + 1) * KZAW_COUNTER_STRIDE)
+
+// Total words per block
+#define KZAW_COUNTER_WORDS KZAW_COUNTER_SHARD (KZAW_COUNTER_SHARDS)
+
+#endif // KZAW_COUNTERS_H
@@ -0,0 +1,437 @@
+// Runtime for binaries built with -fkzaw-self-tune or -fkzaw-force-variants.
+// Link this object in with the tuned code.  The first call to a function
+// dispatched through a table, or program start when KZAW_TUNE_AT_STARTUP is
+// set, picks the variant to use, in this order:
+//  1. a variant forced for the function, if this host supports its ISA;
+//  2. for self-tuned functions, the variant recorded for this host in the
+//     cache file, or else the fastest variant when the function's runner
+//     calls each of them (variants the CPU cannot run stop with SIGILL and
+//     are skipped);
+//  3. the variant the group's resolver picks from the CPU features.
+//
+// Forcing: KZAW_FORCE_VARIANT is a comma-separated list of <function>=<target>
+// entries, where * as the function applies to every function; a lone
+// <target> with no '=' in it is the same as *=<target>.  The file named by KZAW_FORCE_FILE
+// holds one "<function> <target>" line per entry in the same way, and the
+// environment wins over the file.  Targets are written as in target_clones
+// (arch=x86-64-v3) or as in clone names (arch_x86_64_v3).
+//
+// Self-tuning choices are kept in the cache file as one line per function:
+//   <function> <target>
+// A new calibration replaces the function's line, and the file is rewritten
+// through a temporary file and a rename, so it never grows past one line
+// per function and readers never see it half written.  The cache file is
+// KZAW_TUNE_CACHE, or $HOME/.cache/kzaw-tune-<host>.
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+#include "kzaw-tune.h"
+
+#define WARMUP_RUNS 2
+#define TIMED_RUNS 9
+
+typedef uintptr_t kzaw_table[KZAW_TUNE_WORDS];
+typedef void (*kzaw_runner)(void *);
+typedef void *(*kzaw_resolver)(void);
+
+// Bounds of the table section, provided by the linker
+extern kzaw_table __start___kzaw_tune[] __attribute__((weak, visibility("hidden")));
+extern kzaw_table __stop___kzaw_tune[] __attribute__((weak, visibility("hidden")));
+
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set while a runner is being timed, on the thread timing it
+static __thread int calibrating;
+static __thread sigjmp_buf *illegal_jump;
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+on_sigill(int sig)
+{
+  (void) sig;
+  siglongjmp(*illegal_jump, 1);
+}
+
+// Fastest of the timed runs of VARIANT, in nanoseconds, or a negative
+// value if the CPU cannot run it
+static double
+time_variant(kzaw_runner run, void *variant)
+{
+  struct sigaction action, saved;
+  sigjmp_buf env;
+  volatile double best = -1;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_sigill;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGILL, &action, &saved);
+
+  illegal_jump = &env;
+  if (sigsetjmp(env, 1) == 0) {
+    for (int i = 0; i < WARMUP_RUNS; i++)
+      run(variant);
+    for (int i = 0; i < TIMED_RUNS; i++) {
+      double start = now_ns();
+      run(variant);
+      double elapsed = now_ns() - start;
+      if (best < 0 || elapsed < best)
+        best = elapsed;
+    }
+  } else {
+    best = -1;
+  }
+
+  sigaction(SIGILL, &saved, NULL);
+  return best;
+}
+
+// Return true if target names A and B are the same once anything but
+// letters and digits is ignored, which is how clone names spell targets
+static int
+same_target(const char *a, size_t len, const char *b)
+{
+  size_t i = 0;
+  for (; i < len && *b; i++, b++)
+    if (isalnum((unsigned char) a[i]) ? a[i] != *b : isalnum((unsigned char) *b))
+      return 0;
+  return i == len && !*b;
+}
+
+// Return 1 if the host supports feature NAME, 0 if not, -1 if it is not a
+// feature this runtime knows how to check
+static int
+host_feature(const char *name, size_t len)
+{
+  struct feature {
+    const char *name;
+    int supported;
+  };
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  const struct feature features[] = {
+    { "arch=x86-64", 1 },
+    { "arch=x86-64-v2", __builtin_cpu_supports("x86-64-v2") },
+    { "arch=x86-64-v3", __builtin_cpu_supports("x86-64-v3") },
+    { "arch=x86-64-v4", __builtin_cpu_supports("x86-64-v4") },
+    { "sse3", __builtin_cpu_supports("sse3") },
+    { "ssse3", __builtin_cpu_supports("ssse3") },
+    { "sse4.1", __builtin_cpu_supports("sse4.1") },
+    { "sse4.2", __builtin_cpu_supports("sse4.2") },
+    { "popcnt", __builtin_cpu_supports("popcnt") },
+    { "avx", __builtin_cpu_supports("avx") },
+    { "avx2", __builtin_cpu_supports("avx2") },
+    { "fma", __builtin_cpu_supports("fma") },
+    { "bmi", __builtin_cpu_supports("bmi") },
+    { "bmi2", __builtin_cpu_supports("bmi2") },
+    { "avx512f", __builtin_cpu_supports("avx512f") },
+    { "avx512bw", __builtin_cpu_supports("avx512bw") },
+    { "avx512vl", __builtin_cpu_supports("avx512vl") },
+  };
+#elif defined(__aarch64__)
+  unsigned long hwcap = getauxval(AT_HWCAP), hwcap2 = getauxval(AT_HWCAP2);
+  const struct feature features[] = {
+    { "simd", (hwcap & HWCAP_ASIMD) != 0 },
+    { "crc", (hwcap & HWCAP_CRC32) != 0 },
+    { "lse", (hwcap & HWCAP_ATOMICS) != 0 },
+    { "dotprod", (hwcap & HWCAP_ASIMDDP) != 0 },
+    { "sve", (hwcap & HWCAP_SVE) != 0 },
+    { "sve2", (hwcap2 & HWCAP2_SVE2) != 0 },
+    { "rng", (hwcap2 & HWCAP2_RNG) != 0 },
+    { "i8mm", (hwcap2 & HWCAP2_I8MM) != 0 },
+    { "bf16", (hwcap2 & HWCAP2_BF16) != 0 },
+  };
+#else
+  const struct feature features[] = { { "default", 1 } };
+#endif
+
+  for (size_t i = 0; i < sizeof(features) / sizeof(features[0]); i++)
+    if (strlen(features[i].name) == len
+        && strncmp(features[i].name, name, len) == 0)
+      return features[i].supported;
+  return -1;
+}
+
+// Return 1 if the host supports every feature of TARGET, a target string
+// whose features are separated by commas or plus signs, 0 if not, -1 if
+// some feature cannot be checked
+static int
+host_supports(const char *target)
+{
+  int result = 1;
+
+  if (strcmp(target, "default") == 0)
+    return 1;
+  for (const char *p = target; *p; ) {
+    if (*p == '+' || *p == ',') {
+      p++;
+      continue;
+    }
+    size_t len = strcspn(p, "+,");
+    int supported = host_feature(p, len);
+    if (supported <= 0)
+      result = supported < result ? supported : result;
+    p += len;
+  }
+  return result;
+}
+
+// Target forced for FUNCTION by the entries of LIST, separated by SEP and
+// written <function><eq><target>, or NULL.  An entry for FUNCTION beats one
+// for *, and a lone <target> counts as *; *EXACT tells which one matched.
+// The result points into a static buffer.
+static const char *
+forced_in_list(const char *list, char sep, char eq, const char *function,
+               int *exact)
+{
+  static char target[128];
+  const char seps[] = { sep, '\0' };
+  int found = 0;
+
+  for (const char *p = list; *p; ) {
+    size_t len = strcspn(p, seps);
+    const char *mark = memchr(p, eq, len);
+    const char *name = mark ? p : "*";
+    size_t name_len = mark ? (size_t) (mark - p) : 1;
+    const char *value = mark ? mark + 1 : p;
+    size_t value_len = len - (value - p);
+
+    int named = name_len == strlen(function) && strncmp(name, function, name_len) == 0;
+    int global = name_len == 1 && *name == '*';
+    if ((named || (global && found < 2)) && value_len > 0
+        && value_len < sizeof(target)) {
+      memcpy(target, value, value_len);
+      target[value_len] = '\0';
+      found = named ? 2 : 1;
+    }
+    p += len;
+    if (*p)
+      p++;
+  }
+  *exact = found == 2;
+  return found ? target : NULL;
+}
+
+// Target forced for FUNCTION by KZAW_FORCE_VARIANT or KZAW_FORCE_FILE, or
+// NULL
+static const char *
+forced_target(const char *function, int *exact)
+{
+  const char *env = getenv("KZAW_FORCE_VARIANT");
+  if (env) {
+    const char *target = forced_in_list(env, ',', '=', function, exact);
+    if (target)
+      return target;
+  }
+
+  const char *path = getenv("KZAW_FORCE_FILE");
+  FILE *in = path ? fopen(path, "r") : NULL;
+  if (!in)
+    return NULL;
+
+  // Lines become "<function> <target>" entries of a newline-separated list
+  char contents[8192];
+  size_t len = fread(contents, 1, sizeof(contents) - 1, in);
+  fclose(in);
+  contents[len] = '\0';
+  for (char *c = contents; *c; c++)
+    if (*c == '\t')
+      *c = ' ';
+  return forced_in_list(contents, '\n', ' ', function, exact);
+}
+
+// Variant of T forced for this process, or 0.  A forced variant the host
+// cannot run is reported and ignored, as is a variant forced for this
+// function by name that it does not have.
+static uintptr_t
+forced_choice(uintptr_t *t)
+{
+  const char *function = (const char *) t[KZAW_TUNE_NAME];
+  int exact;
+  const char *target = forced_target(function, &exact);
+  if (!target)
+    return 0;
+
+  for (uintptr_t i = 0; i < t[KZAW_TUNE_COUNT]; i++) {
+    const char *variant = (const char *) t[KZAW_TUNE_TARGET(i)];
+    if (!same_target(target, strlen(target), variant))
+      continue;
+
+    int supported = host_supports(variant);
+    if (supported > 0)
+      return t[KZAW_TUNE_ADDRESS(i)];
+    fprintf(stderr, "kzaw-tune: not forcing %s to %s: %s\n", function, variant,
+            supported < 0 ? "cannot check that this host supports it"
+                          : "this host does not support it");
+    return 0;
+  }
+
+  if (exact)
+    fprintf(stderr, "kzaw-tune: %s has no %s variant\n", function, target);
+  return 0;
+}
+
+// Path of the cache file for this host
+static const char *
+cache_path(void)
+{
+  static char path[512];
+  const char *env = getenv("KZAW_TUNE_CACHE");
+  if (env)
+    return env;
+
+  char host[128] = "unknown";
+  gethostname(host, sizeof(host) - 1);
+  const char *home = getenv("HOME");
+  if (home)
+    snprintf(path, sizeof(path), "%s/.cache/kzaw-tune-%s", home, host);
+  else
+    snprintf(path, sizeof(path), "kzaw-tune-%s", host);
+  return path;
+}
+
+// Variant of T recorded in the cache file, or 0.  The last line for the
+// function wins, as in files written before lines were replaced.
+static uintptr_t
+cached_choice(uintptr_t *t)
+{
+  FILE *in = fopen(cache_path(), "r");
+  char line[256], name[128], target[128];
+  uintptr_t choice = 0;
+
+  if (!in)
+    return 0;
+  while (fgets(line, sizeof(line), in)) {
+    if (sscanf(line, "%127s %127s", name, target) != 2
+        || strcmp(name, (const char *) t[KZAW_TUNE_NAME]) != 0)
+      continue;
+    for (uintptr_t i = 0; i < t[KZAW_TUNE_COUNT]; i++)
+      if (strcmp(target, (const char *) t[KZAW_TUNE_TARGET(i)]) == 0)
+        choice = t[KZAW_TUNE_ADDRESS(i)];
+  }
+  fclose(in);
+  return choice;
+}
+
+// Record TARGET as the choice for FUNCTION in the cache file: copy the
+// other functions' lines to a temporary file next to it, add the new line
+// and rename the copy over the file.  Processes calibrating at the same
+// time may lose each other's lines, which only costs a calibration later.
+static void
+record_choice(const char *function, const char *target)
+{
+  const char *path = cache_path();
+  char tmp[600], line[256], name[128];
+
+  if (snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long) getpid()) >= (int) sizeof(tmp))
+    return;
+  FILE *out = fopen(tmp, "w");
+  if (!out)
+    return;
+
+  FILE *in = fopen(path, "r");
+  if (in) {
+    while (fgets(line, sizeof(line), in))
+      if (sscanf(line, "%127s", name) == 1 && strcmp(name, function) != 0
+          && strchr(line, '\n'))
+        fputs(line, out);
+    fclose(in);
+  }
+  fprintf(out, "%s %s\n", function, target);
+
+  if (fclose(out) != 0 || rename(tmp, path) != 0)
+    unlink(tmp);
+}
+
+// Time every variant of T with its runner and return the fastest one
+static uintptr_t
+calibrate(uintptr_t *t)
+{
+  kzaw_runner run = (kzaw_runner) t[KZAW_TUNE_RUNNER];
+  uintptr_t best = 0;
+  double best_ns = -1;
+
+  calibrating = 1;
+  for (uintptr_t i = 0; i < t[KZAW_TUNE_COUNT]; i++) {
+    double ns = time_variant(run, (void *) t[KZAW_TUNE_ADDRESS(i)]);
+    if (ns >= 0 && (best_ns < 0 || ns < best_ns)) {
+      best_ns = ns;
+      best = i;
+    }
+  }
+  calibrating = 0;
+
+  record_choice((const char *) t[KZAW_TUNE_NAME],
+                (const char *) t[KZAW_TUNE_TARGET(best)]);
+  return t[KZAW_TUNE_ADDRESS(best)];
+}
+
+static void *
+select_variant(uintptr_t *t)
+{
+  // A runner that calls another tuned function gets its default
+  if (calibrating)
+    return (void *) t[KZAW_TUNE_ADDRESS(0)];
+
+  pthread_mutex_lock(&tune_lock);
+  uintptr_t current = t[KZAW_TUNE_CURRENT];
+  if (!current) {
+    current = forced_choice(t);
+    if (!current && t[KZAW_TUNE_RUNNER]) {
+      current = cached_choice(t);
+      if (!current)
+        current = calibrate(t);
+    }
+    if (!current)
+      current = (uintptr_t) ((kzaw_resolver) t[KZAW_TUNE_RESOLVER])();
+    __atomic_store_n(&t[KZAW_TUNE_CURRENT], current, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&tune_lock);
+  return (void *) current;
+}
+
+// Called by the dispatch stub of a tuned function while its table has no
+// variant yet; the stub loads the chosen variant itself after that
+void *
+__kzaw_tune_get(uintptr_t *t)
+{
+  uintptr_t current = __atomic_load_n(&t[KZAW_TUNE_CURRENT], __ATOMIC_ACQUIRE);
+  if (__builtin_expect(current != 0, 1))
+    return (void *) current;
+  return select_variant(t);
+}
+
+// Choose for every tuned function at startup when asked to, so no call
+// pays for calibration later
+__attribute__((constructor))
+static void
+kzaw_tune_at_startup(void)
+{
+  kzaw_table *begin = __start___kzaw_tune;
+  kzaw_table *end = __stop___kzaw_tune;
+
+  if (!getenv("KZAW_TUNE_AT_STARTUP"))
+    return;
+  for (kzaw_table *t = begin; t < end; t++)
+    select_variant(*t);
+}
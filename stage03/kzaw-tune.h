@@ -0,0 +1,43 @@
+// Layout of the dispatch tables emitted by -fkzaw-self-tune and
+// -fkzaw-force-variants.
+// Shared by the kzaw pass, which emits one table per such function, and
+// kzaw-tune.c, which picks the variant to call and stores it in the table.
+// Every table is an array of pointer-sized words.
+
+#ifndef KZAW_TUNE_H
+#define KZAW_TUNE_H
+
+// Section holding all tables, so the runtime can walk them with the
+// linker-provided __start_/__stop_ symbols
+#define KZAW_TUNE_SECTION "__kzaw_tune"
+
+// Most variants a tuned function may have, the default included
+#define KZAW_TUNE_MAX_VARIANTS 8
+
+// Word 0 holds the address of the function's name
+#define KZAW_TUNE_NAME 0
+
+// Word 1 holds the calibration runner, void (*) (void *variant), which
+// calls the variant on a small representative input, or 0 for a group
+// that is only dispatched through the table so variants can be forced
+#define KZAW_TUNE_RUNNER 1
+
+// Word 2 holds a copy of the group's resolver, void *(*) (void), giving
+// the variant the CPU features select
+#define KZAW_TUNE_RESOLVER 2
+
+// Word 3 holds the chosen variant, 0 until the runtime has chosen
+#define KZAW_TUNE_CURRENT 3
+
+// Word 4 holds the number of variants
+#define KZAW_TUNE_COUNT 4
+
+// Words holding the target string and the address of variant I; the
+// default, whose target is "default", is variant 0
+#define KZAW_TUNE_TARGET(i) (5 + 2 * (i))
+#define KZAW_TUNE_ADDRESS(i) (6 + 2 * (i))
+
+// Total words per table
+#define KZAW_TUNE_WORDS KZAW_TUNE_TARGET (KZAW_TUNE_MAX_VARIANTS)
+
+#endif // KZAW_TUNE_H
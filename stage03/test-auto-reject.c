@@ -0,0 +1,63 @@
+// Functions -fkzaw-auto-clone must leave alone
+// Each has a vectorizable loop, so only what stops pass_target_clone from
+// versioning it keeps it out of the candidates.  The kzaw-auto-clone dump
+// should show "Auto-cloning" for scale_array alone.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SIZE 1024
+
+// Control – expected to be auto-cloned
+void scale_array(int *arr, int size) {
+    for (int i = 0; i < size; i++)
+        arr[i] = arr[i] * 3 + 1;
+}
+
+// Marked noclone – expected to be skipped
+__attribute__((noclone, noinline))
+void scale_array_noclone(int *arr, int size) {
+    for (int i = 0; i < size; i++)
+        arr[i] = arr[i] * 3 + 1;
+}
+
+// Holds a label a nested function jumps to, which makes the body
+// non-versionable – expected to be skipped
+__attribute__((noinline))
+int scale_array_nonlocal(int *arr, int size) {
+    __label__ fail;
+    void check(int i) {
+        if (arr[i] < 0)
+            goto fail;
+    }
+
+    for (int i = 0; i < size; i++)
+        arr[i] = arr[i] * 3 + 1;
+    check(0);
+    return 0;
+
+fail:
+    return -1;
+}
+
+// main – expected to be skipped, though its loop vectorizes too
+int main(void) {
+    int *arr = malloc(SIZE * sizeof(int));
+    if (!arr)
+        return 1;
+
+    for (int i = 0; i < SIZE; i++)
+        arr[i] = i;
+
+    scale_array(arr, SIZE);
+    scale_array_noclone(arr, SIZE);
+    int status = scale_array_nonlocal(arr, SIZE);
+
+    long sum = 0;
+    for (int i = 0; i < SIZE; i++)
+        sum += arr[i];
+    printf("sum = %ld, status = %d\n", sum, status);
+
+    free(arr);
+    return 0;
+}
@@ -7,6 +7,9 @@
 #ifndef CLONE_ATTRIBUTE
 #define CLONE_ATTRIBUTE
 #endif
+#ifndef CALLER_ATTRIBUTE
+#define CALLER_ATTRIBUTE
+#endif
 
 // Simple arithmetic function – expected to be PRUNED
 CLONE_ATTRIBUTE
@@ -31,6 +34,26 @@ void process_array(int *arr, int size) {
     }
 }
 
+// Caller for -fkzaw-direct-calls: built with CALLER_ATTRIBUTE set to the
+// target of the best add_numbers clone, it calls that clone directly.
+// Not called from main, so the binary still runs on any CPU.
+CALLER_ATTRIBUTE
+int sum_pairs(const int *pairs, int count) {
+    int sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += add_numbers(pairs[2 * i], pairs[2 * i + 1]);
+    return sum;
+}
+
+// Calibration runner for -fkzaw-self-tune=process_array:tune_process_array:
+// calls the process_array variant it is given on a small array
+void tune_process_array(void *variant) {
+    static int data[1024];
+    for (int i = 0; i < 1024; i++)
+        data[i] = i;
+    ((void (*)(int *, int)) variant)(data, 1024);
+}
+
 int main(void) {
     // Test add_numbers
     printf("add_numbers(10,20) = %d\n", add_numbers(10, 20));
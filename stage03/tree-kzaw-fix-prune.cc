@@ -10,6 +10,7 @@
 #include "gimple-iterator.h"
 #include "gimple-walk.h"
 #include "internal-fn.h"
+#include "optabs-query.h"
 #include "gimple-pretty-print.h"
 
 // Additional headers needed for clone analysis
@@ -19,9 +20,25 @@
 #include "pretty-print.h"
 #include "tree-inline.h"
 #include "intl.h"
-#include <map>
-#include <string>
-#include <vector>
+#include "stringpool.h"
+#include "inchash.h"
+#include "varasm.h"
+#include "fold-const.h"
+#include "tree-into-ssa.h"
+#include "diagnostic-core.h"
+#include "cfganal.h"
+#include "cfgcleanup.h"
+#include "cfgloop.h"
+#include "sreal.h"
+#include "target.h"
+#include "common/common-target.h"
+#include "memmodel.h"
+#include "tree-cfg.h"
+#include "except.h"
+#include "version.h"
+#include "rtlhash.h"
+#include "kzaw-counters.h"
+#include "kzaw-tune.h"
 
 namespace {
 
@@ -29,7 +46,7 @@ const pass_data pass_data_kzaw =
 {
   GIMPLE_PASS, /* type */
   "kzaw", /* name */
-  OPTGROUP_NONE, /* optinfo_flags */
+  OPTGROUP_OTHER, /* optinfo_flags */
   TV_TREE_NRV, /* tv_id */
   PROP_cfg , /* properties_required */
   0, /* properties_provided */
@@ -38,396 +55,5016 @@ const pass_data pass_data_kzaw =
   0, /* todo_flags_finish */
 };
 
+// Kind of member within a target_clones group
+enum clone_variant_kind : unsigned char
+{
+  CLONE_VARIANT_DEFAULT,   // The default implementation
+  CLONE_VARIANT_TARGET,    // A target-specific clone
+  CLONE_VARIANT_EXPLORE    // An analysis-only clone from -fkzaw-explore-isa
+};
+
+// Attribute marking functions taking part in -fkzaw-explore-isa.  On the
+// original it holds the group size; on each clone, the candidate target and
+// the original's decl.  The space keeps it out of reach of user code.
+#define KZAW_EXPLORE_ATTR "kzaw explore"
+
+// Attribute marking functions that -fkzaw-auto-clone gave target_clones
+#define KZAW_AUTO_ATTR "kzaw auto"
+
+// Attribute listing the targets removed from target_clones because the
+// function's own target options already provide them
+#define KZAW_IMPLIED_ATTR "kzaw implied"
+
+// Attribute listing the targets removed from target_clones because nothing
+// in the default body can come out differently for them
+#define KZAW_PREDICTED_ATTR "kzaw predicted"
+
+// Attribute listing the targets removed from target_clones because no host
+// of -fkzaw-fleet-manifest would have its resolver select them
+#define KZAW_FLEET_ATTR "kzaw fleet"
+
+// Attribute holding the target of the variant that every host of the fleet
+// supports, when no host would select the default.  The kzaw pass turns the
+// default into a call to that variant once it has been compared.
+#define KZAW_FLEET_FALLBACK_ATTR "kzaw fleet fallback"
+
+// Attribute listing, for each target string, how many hosts of
+// -fkzaw-fleet-manifest would have the resolver select it
+#define KZAW_FLEET_HOSTS_ATTR "kzaw fleet hosts"
+
+// Attribute listing the targets removed from target_clones to keep the
+// unit within --param=kzaw-clone-size-budget
+#define KZAW_BUDGET_ATTR "kzaw budget"
+
+// Attribute marking the default version of a group whose resolver now
+// returns a -fkzaw-self-tune dispatch stub
+#define KZAW_TUNED_ATTR "kzaw tuned"
+
+// Attribute holding the key of a target_clones function in the
+// -fkzaw-decision-manifest file and the fingerprint of its body
+#define KZAW_FINGERPRINT_ATTR "kzaw fingerprint"
+
+// Attribute listing the targets removed from target_clones because the
+// decision manifest records them as identical to the default for the same
+// fingerprint
+#define KZAW_MANIFEST_ATTR "kzaw manifest"
+
+// Flattened form of one GIMPLE statement.  Only codes, hashes and a copy
+// of the constants are kept, so a signature stays valid after the function
+// it came from has been expanded to RTL and its GIMPLE body released.
+struct stmt_sig
+{
+  unsigned short code;     // gimple_code
+  unsigned short subcode;  // rhs code, condition code, internal fn or has-retval
+  unsigned int nops;       // Operand count (assign) or argument count (call)
+  hashval_t op_codes;      // TREE_CODEs of the operands, or callee kind
+  hashval_t op_values;     // Constant operand values, or callee name
+  char *exact;             // The same values spelled out in full, for when
+                           // the hashes match, or NULL if there are none
+  location_t locus;        // Source location, for reporting only
+};
+
+// The kzaw pass, whose groups pass_kzaw_rtl flushes at the end of the unit
+class pass_kzaw;
+static pass_kzaw *kzaw_pass;
+
 class pass_kzaw : public gimple_opt_pass
 {
 public:
   pass_kzaw (gcc::context *ctxt)
-    : gimple_opt_pass (pass_data_kzaw, ctxt)
-  {}
+    : gimple_opt_pass (pass_data_kzaw, ctxt), counter_enter_fn (NULL_TREE)
+  {
+    kzaw_pass = this;
+  }
 
   bool gate (function *) final override {
     return 1;
   }
 
   unsigned int execute (function *) final override;
+  void finish_unit();
 
 private:
   // Data structure to store function information
   struct function_info {
-    tree decl;                 // Function declaration
-    function *fun;             // Function pointer
-    std::string base_name;     // Base function name (without variant)
-    std::string variant;       // Variant part of the name
-    std::vector<gimple *> stmts; // Statements in the function
+    unsigned uid;              // cgraph UID of the member
+    location_t locus;          // Source location of the function
+    clone_variant_kind kind;   // Default or target variant
+    char *variant;             // Variant suffix
+    char *target;              // Target string of a target variant, for the
+                               // decision manifest, or NULL
+    vec<stmt_sig> stmts;       // Statement signatures of the function
+  };
+
+  // All members of a target_clones group seen so far
+  struct clone_group {
+    char *base_name;               // Name shared by the group
+    unsigned expected;             // Versions defined in the unit, 0 if unknown
+    bool automatic;                // Created by -fkzaw-auto-clone
+    char *manifest_key;            // Key and fingerprint for the decision
+    char *fingerprint;             // manifest, or NULL
+    vec<function_info> members;
   };
 
-  std::map<std::string, std::vector<function_info>> clone_groups;
+  // Groups keyed by the cgraph UID of the first version in the chain, which
+  // is never reused.  Groups outlive the function being expanded, and the
+  // collector runs in between, so they hold their own copies of the names
+  // rather than trees.
+  typedef int_hash<int, -1, -2> group_key;
+  hash_map<group_key, clone_group> clone_groups;
+
+  // Counter blocks for -fkzaw-instrument-clones, keyed by variant decl.
+  // Once finalized the blocks are reachable from the varpool, and the
+  // runtime entry point from the callgraph, so both survive collection.
+  hash_map<tree, tree> counter_blocks;
+  tree counter_enter_fn;
 
   // Helper methods
-  bool is_clone_function(tree decl, std::string &base_name, std::string &variant);
-  void collect_function_statements(function *fun, std::vector<gimple *> &stmts);
-  bool compare_functions(const std::vector<gimple *> &func1_stmts, 
-                         const std::vector<gimple *> &func2_stmts);
-  void print_prune_decision(const std::string &base_name, bool should_prune);
+  bool is_clone_function(tree decl, int *group_uid, tree *base_name,
+                         clone_variant_kind *kind, tree *variant);
+  void collect_function_statements(function *fun, vec<stmt_sig> *stmts);
+  bool compare_functions(const vec<stmt_sig> &func1_stmts,
+                         const vec<stmt_sig> &func2_stmts,
+                         const char **reason, unsigned *where);
+  void print_prune_decision(const char *base_name, bool should_prune);
+  void analyze_group(clone_group &group);
+  void release_group(clone_group &group);
+  bool report_explore(const char *base, const function_info &default_info,
+                      const function_info &variant_info);
+  void flush_clone_groups();
+  tree get_counter_block(tree fndecl);
+  gimple *build_selection_store(tree fndecl);
+  void instrument_clone(function *fun);
+  void instrument_resolver(function *fun);
 };
 
-// Check if a function is a clone
-bool
-pass_kzaw::is_clone_function(tree decl, std::string &base_name, std::string &variant)
-{
-  // Get the function name
-  const char *full_name = IDENTIFIER_POINTER(DECL_NAME(decl));
-  std::string func_name(full_name);
-  
-  // First check if this is a variant function (with dot in name)
-  size_t dot_pos = func_name.find('.');
-  if (dot_pos != std::string::npos) {
-    base_name = func_name.substr(0, dot_pos);
-    variant = func_name.substr(dot_pos);
-
-    // Skip resolver functions
-    if (variant == ".resolver") {
-      return false;
-    }
+// First version in the function-version chain of NODE, or NULL if NODE
+// is not multiversioned
+static cgraph_function_version_info *
+first_version(cgraph_node *node)
+{
+  cgraph_function_version_info *v = node->function_version();
+  if (v)
+    while (v->prev)
+      v = v->prev;
+  return v;
+}
 
-    if (dump_file) {
-      fprintf(dump_file, "Found potential clone: %s (base: %s, variant: %s)\n", 
-              full_name, base_name.c_str(), variant.c_str());
-    }
-    return true;
-  }
-  
-  // Check if it's a default function with target_clones attribute
-  if (lookup_attribute("target_clones", DECL_ATTRIBUTES(decl))) {
-    base_name = func_name;
-    variant = ".default";  // Use .default to mark it as the default variant
-    
-    if (dump_file) {
-      fprintf(dump_file, "Found default function with clones: %s\n", full_name);
-    }
-    return true;
-  }
+// Number of members in the group of DECL: the size recorded for an
+// explored function, or the versions of the chain defined in this unit
+static unsigned
+count_clone_targets(tree decl)
+{
+  tree attr = lookup_attribute(KZAW_EXPLORE_ATTR, DECL_ATTRIBUTES(decl));
+  if (attr && TREE_CODE(TREE_VALUE(TREE_VALUE(attr))) == INTEGER_CST)
+    return tree_to_uhwi(TREE_VALUE(TREE_VALUE(attr)));
+
+  cgraph_node *node = cgraph_node::get(decl);
+  unsigned count = 0;
+  for (cgraph_function_version_info *v = node ? first_version(node) : NULL;
+       v; v = v->next)
+    if (v->this_node->definition && !v->this_node->alias)
+      count++;
+  return count;
+}
+
+// Suffix naming target TARGET in dumps, in the form pass_target_clone gives
+// clone names: a dot, then the target with anything but letters and digits
+// replaced.  Built on the stack; only the identifier lookup remains.
+static tree
+target_suffix(const char *target)
+{
+  size_t len = strlen(target);
+  char *buf = XALLOCAVEC(char, len + 2);
+  buf[0] = '.';
+  for (size_t i = 0; i < len; i++)
+    buf[i + 1] = ISALNUM(target[i]) ? target[i] : '_';
+  buf[len + 1] = '\0';
+  return get_identifier_with_length(buf, len + 1);
+}
+
+// Target string of version DECL, "default" for the default version, taken
+// from its target or target_version attribute, which covers target_clones,
+// target and target_version groups alike.  NULL if DECL has neither.
+static const char *
+version_target(tree decl)
+{
+  if (is_function_default_version(decl))
+    return "default";
+
+  tree attr = lookup_attribute("target_version", DECL_ATTRIBUTES(decl));
+  if (!attr)
+    attr = lookup_attribute("target", DECL_ATTRIBUTES(decl));
+  if (!attr || !TREE_VALUE(attr))
+    return NULL;
+  return TREE_STRING_POINTER(TREE_VALUE(TREE_VALUE(attr)));
+}
+
+// Suffix naming version DECL, built from its target string so it does not
+// depend on how the target mangles version names
+static tree
+version_suffix(tree decl)
+{
+  const char *target = version_target(decl);
+  return target_suffix(target ? target : "unknown");
+}
+
+// Check if a function is the ifunc resolver made for a version group:
+// a compiler-generated function that an ifunc alias resolves through
+static bool
+is_resolver_function(tree decl)
+{
+  cgraph_node *node = cgraph_node::get(decl);
+  if (!node || !DECL_ARTIFICIAL(decl))
+    return false;
 
+  ipa_ref *ref;
+  FOR_EACH_ALIAS(node, ref) {
+    if (ref->referring->ifunc_resolver)
+      return true;
+  }
   return false;
 }
 
-// Collect all statements from a function
-void
-pass_kzaw::collect_function_statements(function *fun, std::vector<gimple *> &stmts)
+// Resolver of the version group of NODE, or NULL if none was generated
+static cgraph_node *
+group_resolver(cgraph_node *node)
 {
-  basic_block bb;
+  for (cgraph_function_version_info *v = first_version(node); v; v = v->next)
+    if (v->dispatcher_resolver)
+      if (cgraph_node *dispatcher = cgraph_node::get(v->dispatcher_resolver)) {
+        cgraph_node *resolver = dispatcher->get_alias_target();
+        return resolver && resolver->definition ? resolver : NULL;
+      }
+  return NULL;
+}
+
+// Report the variants of FNDECL that were dropped before cloning: because
+// the baseline options already imply them, because the predictor found
+// nothing in the body that could differ, because no host of the fleet
+// selects them, to stay within the size budget, or because an earlier build
+// pruned them.  Names use the clone suffix form.
+static void
+report_dropped_variants(tree fndecl, const char *base)
+{
+  static const struct {
+    const char *attr;
+    const char *reason;
+  } dropped[] = {
+    { KZAW_IMPLIED_ATTR, "implied by the baseline target" },
+    { KZAW_PREDICTED_ATTR, "predicted identical to the default" },
+    { KZAW_FLEET_ATTR, "no host of the fleet selects it" },
+    { KZAW_BUDGET_ATTR, "over the clone size budget" },
+    { KZAW_MANIFEST_ATTR, "pruned in an earlier build" }
+  };
 
-  // Clear the vector in case it's being reused
-  stmts.clear();
+  if (!dump_file && !dump_enabled_p())
+    return;
 
-  // Collect all statements in the function
-  FOR_EACH_BB_FN(bb, fun) {
-    for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
-      gimple *stmt = gsi_stmt(gsi);
-      stmts.push_back(stmt);
+  for (unsigned i = 0; i < ARRAY_SIZE(dropped); i++) {
+    tree attr = lookup_attribute(dropped[i].attr, DECL_ATTRIBUTES(fndecl));
+    if (!attr)
+      continue;
+
+    for (tree t = TREE_VALUE(attr); t; t = TREE_CHAIN(t)) {
+      tree suffix = target_suffix(TREE_STRING_POINTER(TREE_VALUE(t)));
+      if (dump_file)
+        fprintf(dump_file, "PRUNE: %s%s (%s)\n",
+                base, IDENTIFIER_POINTER(suffix), dropped[i].reason);
+      if (dump_enabled_p())
+        dump_printf_loc(MSG_OPTIMIZED_LOCATIONS,
+                        dump_user_location_t::from_location_t(DECL_SOURCE_LOCATION(fndecl)),
+                        "clone %s%s not created: %s\n",
+                        base, IDENTIFIER_POINTER(suffix), dropped[i].reason);
     }
   }
+}
 
-  if (dump_file) {
-    fprintf(dump_file, "Collected %zu statements from function %s\n", 
-            stmts.size(), function_name(fun));
+// Return the function whose address VAL holds, or NULL_TREE
+static tree
+address_of_function(tree val)
+{
+  while (val && TREE_CODE(val) == SSA_NAME) {
+    gimple *def = SSA_NAME_DEF_STMT(val);
+    if (!is_gimple_assign(def)
+        || !(gimple_assign_single_p(def)
+             || CONVERT_EXPR_CODE_P(gimple_assign_rhs_code(def))))
+      return NULL_TREE;
+    val = gimple_assign_rhs1(def);
   }
+  if (!val)
+    return NULL_TREE;
+
+  STRIP_NOPS(val);
+  if (TREE_CODE(val) == ADDR_EXPR
+      && TREE_CODE(TREE_OPERAND(val, 0)) == FUNCTION_DECL)
+    return TREE_OPERAND(val, 0);
+  return NULL_TREE;
 }
 
-// Compare two functions for substantial similarity
-bool
-pass_kzaw::compare_functions(const std::vector<gimple *> &func1_stmts, 
-                             const std::vector<gimple *> &func2_stmts)
+// Return true if the constants and callee of two signatures are the same,
+// not just their hashes
+static bool
+stmt_exact_equal(const stmt_sig &a, const stmt_sig &b)
 {
-  // First check: different statement count means different functions
-  if (func1_stmts.size() != func2_stmts.size()) {
+  if (!a.exact || !b.exact)
+    return a.exact == b.exact;
+  return strcmp(a.exact, b.exact) == 0;
+}
+
+// Return true if two statement signatures are identical in every field
+static bool
+stmt_sig_equal(const stmt_sig &a, const stmt_sig &b)
+{
+  return (a.code == b.code && a.subcode == b.subcode && a.nops == b.nops
+          && a.op_codes == b.op_codes && a.op_values == b.op_values
+          && stmt_exact_equal(a, b));
+}
+
+// Number of statements that differ between two functions, counting
+// positional mismatches plus the difference in length
+static unsigned
+count_differences(const vec<stmt_sig> &a, const vec<stmt_sig> &b)
+{
+  unsigned common = MIN(a.length(), b.length());
+  unsigned diffs = MAX(a.length(), b.length()) - common;
+
+  for (unsigned i = 0; i < common; i++)
+    if (!stmt_sig_equal(a[i], b[i]))
+      diffs++;
+  return diffs;
+}
+
+// Reduce an explore clone to an empty body once it has been measured.
+// The clone is still expanded and emitted, as a stub in its own section.
+static void
+discard_function_body(function *fun)
+{
+  basic_block bb = split_edge(single_succ_edge(ENTRY_BLOCK_PTR_FOR_FN(fun)));
+  gimple_stmt_iterator gsi = gsi_last_bb(bb);
+  gsi_insert_after(&gsi, gimple_build_call(builtin_decl_implicit(BUILT_IN_UNREACHABLE), 0),
+                   GSI_NEW_STMT);
+
+  remove_edge(single_succ_edge(bb));
+  delete_unreachable_blocks();
+  if (current_loops)
+    loops_state_set(LOOPS_NEED_FIXUP);
+
+  // Nothing references the stubs, so --gc-sections can drop the section
+  set_decl_section_name(fun->decl, ".text.kzaw_explore");
+}
+
+// New register of TYPE for FUN, the current function, in or out of SSA
+static tree
+new_temporary(function *fun, tree type)
+{
+  return gimple_in_ssa_p(fun) ? make_ssa_name(type) : create_tmp_reg(type);
+}
+
+// Replace the body of FUN, the current function, with the statements of
+// SEQ followed by a tail call to CALLEE, a function decl or a pointer that
+// SEQ computes, passing every argument on and returning the result.
+// Virtual operands are left for the caller to update.
+static void
+forward_function_body(function *fun, gimple_seq seq, tree callee)
+{
+  // Cut the body off behind a new entry block, which becomes the only
+  // block left
+  basic_block bb = split_edge(single_succ_edge(ENTRY_BLOCK_PTR_FOR_FN(fun)));
+  remove_edge(single_succ_edge(bb));
+  make_single_succ_edge(bb, EXIT_BLOCK_PTR_FOR_FN(fun), EDGE_FALLTHRU);
+  free_dominance_info(CDI_DOMINATORS);
+  delete_unreachable_blocks();
+  if (current_loops)
+    loops_state_set(LOOPS_NEED_FIXUP);
+
+  tree fntype = TREE_TYPE(fun->decl);
+  auto_vec<tree> args;
+  for (tree parm = DECL_ARGUMENTS(fun->decl); parm; parm = DECL_CHAIN(parm))
+    args.safe_push(gimple_in_ssa_p(fun) && is_gimple_reg(parm)
+                   ? get_or_create_ssa_default_def(fun, parm) : parm);
+
+  gcall *call = gimple_build_call_vec(callee, args);
+  gimple_call_set_fntype(call, fntype);
+  tree retval = NULL_TREE;
+  if (!VOID_TYPE_P(TREE_TYPE(fntype))) {
+    retval = new_temporary(fun, TREE_TYPE(fntype));
+    gimple_call_set_lhs(call, retval);
+  }
+  gimple_call_set_tail(call, true);
+  gimple_seq_add_stmt(&seq, call);
+  gimple_seq_add_stmt(&seq, gimple_build_return(retval));
+
+  gimple_stmt_iterator gsi = gsi_start_bb(bb);
+  gsi_insert_seq_after(&gsi, seq, GSI_NEW_STMT);
+}
+
+// If the default version FUN carries KZAW_FLEET_FALLBACK_ATTR, replace its
+// body with a call to the variant named there and return true.  Calls only
+// reach the default directly, as pass_target_clone routes them from the
+// defaults of other groups, so this keeps them on code the host can run.
+static bool
+fleet_fallback(function *fun)
+{
+  tree attr = lookup_attribute(KZAW_FLEET_FALLBACK_ATTR, DECL_ATTRIBUTES(fun->decl));
+  cgraph_node *node = cgraph_node::get(fun->decl);
+  if (!attr || !node)
+    return false;
+
+  const char *target = TREE_STRING_POINTER(TREE_VALUE(attr));
+  for (cgraph_function_version_info *v = first_version(node); v; v = v->next) {
+    cgraph_node *version = v->this_node;
+    const char *version_str = version_target(version->decl);
+    if (version == node || !version->definition || version->dispatcher_function
+        || !version_str || strcmp(version_str, target) != 0)
+      continue;
+
     if (dump_file) {
-      fprintf(dump_file, "Functions have different statement counts: %zu vs %zu\n", 
-              func1_stmts.size(), func2_stmts.size());
+      fprintf(dump_file, "Reducing %s to a call to %s: no host of the fleet "
+              "selects it\n", node->dump_name(), version->dump_name());
     }
-    return false;
+    forward_function_body(fun, NULL, version->decl);
+    return true;
   }
+  return false;
+}
 
-  // Maps to track equivalent SSA names between the two functions
-  std::map<tree, tree> ssa_map;
-  
-  // Iterate through statements and compare them
-  for (size_t i = 0; i < func1_stmts.size(); i++) {
-    gimple *stmt1 = func1_stmts[i];
-    gimple *stmt2 = func2_stmts[i];
+// One record of the -fkzaw-decision-manifest file: a target of a function
+// that the kzaw pass found identical to the default
+struct manifest_entry
+{
+  char *fingerprint;   // Fingerprint of the function when it was decided
+  char *target;        // Target string, as in target_clones
+  char *function;      // Source file and assembler name, see manifest_key
+};
 
-    // Add safety check for null statements
-    if (!stmt1 || !stmt2) {
-      if (dump_file) {
-        fprintf(dump_file, "Statement %zu: One or both statements are null\n", i);
-      }
-      return false;
+// Records read by pass_ipa_kzaw_manifest and added by the kzaw pass, and
+// whether they differ from the file
+static vec<manifest_entry> manifest_entries;
+static bool manifest_changed;
+
+// A variant whose GIMPLE the kzaw pass found identical to the default's.
+// It only becomes a record once the RTL of both matches as well: the
+// expanders still pick instructions by target, so __builtin_popcount under
+// popcnt, or a shift under BMI2, tells the variants apart after GIMPLE.
+struct pending_decision
+{
+  manifest_entry entry;
+  int default_uid;     // cgraph UIDs of the two functions, for
+  int variant_uid;     // rtl_fingerprints
+};
+static vec<pending_decision> pending_decisions;
+
+// Fingerprints of the final RTL of the multiversioned functions of the
+// unit, by cgraph UID, taken by pass_kzaw_rtl
+typedef hash_map<int_hash<int, -1, -2>, unsigned HOST_WIDE_INT> rtl_fingerprint_map;
+static rtl_fingerprint_map *rtl_fingerprints;
+
+// Seed of the second half of a fingerprint.  Each fingerprint is two
+// inchash values over the same data, so that an unrelated body matching a
+// record by chance is a 64-bit collision rather than a 32-bit one.
+#define KZAW_FINGERPRINT_SEED 0x6b7a6177
+
+// Note that TARGET of the function with manifest key FUNCTION and
+// fingerprint FINGERPRINT came out identical to the default at GIMPLE,
+// comparing cgraph nodes DEFAULT_UID and VARIANT_UID
+static void
+record_manifest_decision(const char *function, const char *target,
+                         const char *fingerprint, int default_uid,
+                         int variant_uid)
+{
+  pending_decision d;
+  d.entry.fingerprint = xstrdup(fingerprint);
+  d.entry.target = xstrdup(target);
+  d.entry.function = xstrdup(function);
+  d.default_uid = default_uid;
+  d.variant_uid = variant_uid;
+  pending_decisions.safe_push(d);
+}
+
+// Add the pending decisions whose two functions left the same RTL to the
+// records, and drop the others
+static void
+confirm_manifest_decisions()
+{
+  for (unsigned i = 0; i < pending_decisions.length(); i++) {
+    pending_decision &d = pending_decisions[i];
+    unsigned HOST_WIDE_INT *def = NULL, *var = NULL;
+    if (rtl_fingerprints) {
+      def = rtl_fingerprints->get(d.default_uid);
+      var = rtl_fingerprints->get(d.variant_uid);
     }
-    
-    // Check if statement codes are different
-    if (gimple_code(stmt1) != gimple_code(stmt2)) {
-      if (dump_file) {
-        fprintf(dump_file, "Statement %zu: Different gimple codes (%d vs %d)\n", 
-                i, gimple_code(stmt1), gimple_code(stmt2));
 
-        // Use safer printing method without TDF_SLIM flag, which might be causing issues on AArch64
-        fprintf(dump_file, "Statement 1 code: %d\n", gimple_code(stmt1));
-        fprintf(dump_file, "Statement 2 code: %d\n", gimple_code(stmt2));
-      }
-      return false;
+    if (def && var && *def == *var) {
+      manifest_entries.safe_push(d.entry);
+      manifest_changed = true;
+      continue;
     }
-    
-    // Compare based on statement type
-    switch (gimple_code(stmt1)) {
-    case GIMPLE_ASSIGN:
-      {
-        // Check operation code
-        if (gimple_assign_rhs_code(stmt1) != gimple_assign_rhs_code(stmt2)) {
-          if (dump_file) {
-            fprintf(dump_file, "Assignment operation mismatch at statement %zu\n", i);
-          }
-          return false;
-        }
-        
-        // Check operand count
-        unsigned op_count1 = gimple_num_ops(stmt1);
-        unsigned op_count2 = gimple_num_ops(stmt2);
-        if (op_count1 != op_count2) {
-          if (dump_file) {
-            fprintf(dump_file, "Different number of operands at statement %zu\n", i);
-          }
-          return false;
-        }
-        
-        // For constants and literals, values must match exactly
-        for (unsigned j = 1; j < op_count1; j++) {
-          tree op1 = gimple_op(stmt1, j);
-          tree op2 = gimple_op(stmt2, j);
-          
-          if (TREE_CODE(op1) != TREE_CODE(op2)) {
-            if (dump_file) {
-              fprintf(dump_file, "Different operand types at statement %zu\n", i);
-            }
-            return false;
-          }
-          
-          // For constants, compare values
-          if (CONSTANT_CLASS_P(op1) && CONSTANT_CLASS_P(op2)) {
-            if (!vrp_operand_equal_p(op1, op2)) {
-              if (dump_file) {
-                fprintf(dump_file, "Different constant values at statement %zu\n", i);
-              }
-              return false;
-            }
-          }
-        }
-      }
-      break;
-      
-    case GIMPLE_CALL:
-      {
-        // Check if calling the same function
-        tree func1 = gimple_call_fn(as_a<gcall *>(stmt1));
-        tree func2 = gimple_call_fn(as_a<gcall *>(stmt2));
-        
-        if (TREE_CODE(func1) != TREE_CODE(func2)) {
-          if (dump_file) {
-            fprintf(dump_file, "Different function call types at statement %zu\n", i);
-          }
-          return false;
-        }
-        
-        // If it's a direct function call, compare the function declarations
-        if (TREE_CODE(func1) == ADDR_EXPR) {
-          tree fn_decl1 = TREE_OPERAND(func1, 0);
-          tree fn_decl2 = TREE_OPERAND(func2, 0);
-          
-          if (DECL_NAME(fn_decl1) != DECL_NAME(fn_decl2)) {
-            if (dump_file) {
-              fprintf(dump_file, "Calling different functions at statement %zu\n", i);
-            }
-            return false;
-          }
-        }
-        
-        // Check argument count
-        unsigned arg_count1 = gimple_call_num_args(as_a<gcall *>(stmt1));
-        unsigned arg_count2 = gimple_call_num_args(as_a<gcall *>(stmt2));
-        if (arg_count1 != arg_count2) {
-          if (dump_file) {
-            fprintf(dump_file, "Different number of arguments in call at statement %zu\n", i);
-          }
-          return false;
-        }
-      }
-      break;
-      
-    case GIMPLE_COND:
-      {
-        // Check condition code
-        enum tree_code code1 = gimple_cond_code(as_a<gcond *>(stmt1));
-        enum tree_code code2 = gimple_cond_code(as_a<gcond *>(stmt2));
-        if (code1 != code2) {
-          if (dump_file) {
-            fprintf(dump_file, "Different conditional codes at statement %zu\n", i);
-          }
-          return false;
-        }
-      }
-      break;
-      
-    case GIMPLE_RETURN:
-      {
-        // Check if one returns a value and the other doesn't
-        tree ret_val1 = gimple_return_retval(as_a<greturn *>(stmt1));
-        tree ret_val2 = gimple_return_retval(as_a<greturn *>(stmt2));
-        
-        if ((ret_val1 == NULL_TREE) != (ret_val2 == NULL_TREE)) {
-          if (dump_file) {
-            fprintf(dump_file, "One function returns a value, the other doesn't at statement %zu\n", i);
-          }
-          return false;
-        }
-      }
-      break;
-      
-    default:
-      // For other statement types, we consider them the same if the code matches
-      break;
+
+    if (dump_file) {
+      fprintf(dump_file, "Not recording %s of %s: its RTL %s\n",
+              d.entry.target, d.entry.function,
+              def && var ? "differs from the default" : "was not seen");
     }
+    free(d.entry.fingerprint);
+    free(d.entry.target);
+    free(d.entry.function);
   }
-  
-  // If we've made it this far, the functions are considered substantially the same
-  if (dump_file) {
-    fprintf(dump_file, "Functions are substantially the same\n");
-  }
-  return true;
+  pending_decisions.release();
 }
 
-// Print the pruning decision
-void
-pass_kzaw::print_prune_decision(const std::string &base_name, bool should_prune)
+// Write the records back to the -fkzaw-decision-manifest file.  The file is
+// replaced by a rename, so a compilation reading it meanwhile sees either
+// the old records or the new ones.
+static void
+write_decision_manifest()
 {
-  if (dump_file) {
-    if (should_prune) {
-      fprintf(dump_file, "PRUNE: %s\n", base_name.c_str());
-    } else {
-      fprintf(dump_file, "NOPRUNE: %s\n", base_name.c_str());
-    }
+  char *tmp = xasprintf("%s.%d", flag_kzaw_decision_manifest, (int) getpid());
+  FILE *out = fopen(tmp, "w");
+  if (!out) {
+    warning(0, "cannot write decision manifest %qs: %m", tmp);
+    free(tmp);
+    return;
+  }
+
+  fprintf(out, "# kzaw decision manifest: <fingerprint> <target> <file>:<function>\n");
+  for (unsigned i = 0; i < manifest_entries.length(); i++)
+    fprintf(out, "%s %s %s\n", manifest_entries[i].fingerprint,
+            manifest_entries[i].target, manifest_entries[i].function);
+
+  if (fclose(out) != 0 || rename(tmp, flag_kzaw_decision_manifest) != 0) {
+    warning(0, "cannot write decision manifest %qs: %m",
+            flag_kzaw_decision_manifest);
+    unlink(tmp);
   }
+  free(tmp);
+  manifest_changed = false;
 }
 
-// Main execution function for the pass
-unsigned int
-pass_kzaw::execute(function *fun)
+// Free the records once the unit no longer needs them
+static void
+release_manifest_entries()
 {
-  // Get the function declaration
-  tree fndecl = current_function_decl;
-  
-  // Skip external functions or those with no body
-  if (!fndecl || DECL_EXTERNAL(fndecl) || !DECL_STRUCT_FUNCTION(fndecl)) {
-    return 0;
+  for (unsigned i = 0; i < manifest_entries.length(); i++) {
+    free(manifest_entries[i].fingerprint);
+    free(manifest_entries[i].target);
+    free(manifest_entries[i].function);
   }
-  
-  // Check if this is a clone function or a default function with clones
-  std::string base_name, variant;
-  bool is_clone_or_default = is_clone_function(fndecl, base_name, variant);
+  manifest_entries.release();
+}
 
-  if (!is_clone_or_default) {
-    const char *func_name = IDENTIFIER_POINTER(DECL_NAME(fndecl));
-    if (dump_file)
-      fprintf(dump_file, "NOPRUNE: %s\n", func_name);
-    return 0;
-  }
-  
-  if (is_clone_or_default) {
-    // Collect statements in this function
-    function_info info;
-    info.decl = fndecl;
-    info.fun = fun;
-    info.base_name = base_name;
-    info.variant = variant;
-    collect_function_statements(fun, info.stmts);
-    
-    if (dump_file) {
-      fprintf(dump_file, "Collected %zu statements from function %s%s\n", 
-              info.stmts.size(), base_name.c_str(), variant.c_str());
+// Append the formatted text to BUF
+static void ATTRIBUTE_PRINTF_2
+exact_printf(vec<char> *buf, const char *fmt, ...)
+{
+  char tmp[64];
+  va_list ap;
+
+  va_start(ap, fmt);
+  int len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  for (int i = 0; i < len && i < (int) sizeof(tmp) - 1; i++)
+    buf->safe_push(tmp[i]);
+}
+
+// Append constant OP to BUF in full: its code, its type's mode, precision
+// and signedness, and the bits of its value, so that two constants are
+// spelled alike only if they are the same value of the same type
+static void
+encode_constant(tree op, vec<char> *buf)
+{
+  tree type = TREE_TYPE(op);
+  exact_printf(buf, "%d", (int) TREE_CODE(op));
+  if (type && TYPE_P(type))
+    exact_printf(buf, ":%d:%u%c", (int) TYPE_MODE(type), TYPE_PRECISION(type),
+                 TYPE_UNSIGNED(type) ? 'u' : 's');
+
+  switch (TREE_CODE(op)) {
+  case INTEGER_CST:
+    for (int i = 0; i < TREE_INT_CST_NUNITS(op); i++)
+      exact_printf(buf, " " HOST_WIDE_INT_PRINT_HEX, TREE_INT_CST_ELT(op, i));
+    break;
+
+  case REAL_CST:
+    {
+      long bits[4] = { 0, 0, 0, 0 };
+      real_to_target(bits, TREE_REAL_CST_PTR(op), TYPE_MODE(type));
+      for (int i = 0; i < 4; i++)
+        exact_printf(buf, " %lx", bits[i]);
     }
-    
-    // Add to the appropriate clone group
-    auto &group = clone_groups[base_name];
-    group.push_back(info);
+    break;
 
-    if (info.variant == ".default" && group.size() == 1) {
-      if (dump_file)
-        fprintf(dump_file, "NOPRUNE: %s%s\n", 
-                base_name.c_str(), info.variant.c_str());
-      return 0;
+  case FIXED_CST:
+    exact_printf(buf, " " HOST_WIDE_INT_PRINT_HEX " " HOST_WIDE_INT_PRINT_HEX,
+                 (HOST_WIDE_INT) TREE_FIXED_CST(op).data.low,
+                 TREE_FIXED_CST(op).data.high);
+    break;
+
+  case STRING_CST:
+    exact_printf(buf, " %d ", TREE_STRING_LENGTH(op));
+    for (int i = 0; i < TREE_STRING_LENGTH(op); i++)
+      exact_printf(buf, "%02x", (unsigned char) TREE_STRING_POINTER(op)[i]);
+    break;
+
+  case COMPLEX_CST:
+    exact_printf(buf, " (");
+    encode_constant(TREE_REALPART(op), buf);
+    exact_printf(buf, ", ");
+    encode_constant(TREE_IMAGPART(op), buf);
+    exact_printf(buf, ")");
+    break;
+
+  case VECTOR_CST:
+    exact_printf(buf, " %u*%u (", VECTOR_CST_NPATTERNS(op),
+                 VECTOR_CST_NELTS_PER_PATTERN(op));
+    for (unsigned i = 0; i < vector_cst_encoded_nelts(op); i++) {
+      if (i)
+        exact_printf(buf, ", ");
+      encode_constant(VECTOR_CST_ENCODED_ELT(op, i), buf);
     }
-    
-    // Check if we've seen enough clones of this function to make a decision
-    if (clone_groups[base_name].size() >= 2) {
-      if (dump_file) {
-        fprintf(dump_file, "Analyzing clones of function: %s\n", base_name.c_str());
-      }
-      
-      // Find the default variant to use as reference
-      size_t default_idx = 0;
-      for (size_t i = 0; i < clone_groups[base_name].size(); i++) {
-        if (clone_groups[base_name][i].variant == ".default") {
-          default_idx = i;
-          break;
-        }
+    exact_printf(buf, ")");
+    break;
+
+  case POLY_INT_CST:
+    exact_printf(buf, " (");
+    for (unsigned i = 0; i < NUM_POLY_INT_COEFFS; i++) {
+      if (i)
+        exact_printf(buf, ", ");
+      encode_constant(POLY_INT_CST_COEFF(op, i), buf);
+    }
+    exact_printf(buf, ")");
+    break;
+
+  default:
+    break;
+  }
+  exact_printf(buf, ";");
+}
+
+// Fill SIG with the parts of STMT that the comparison looks at.  SIG owns
+// its EXACT string from then on.
+static void
+encode_statement(gimple *stmt, stmt_sig *sig)
+{
+  inchash::hash codes, values;
+  auto_vec<char, 64> exact;
+
+  sig->code = gimple_code(stmt);
+  sig->subcode = 0;
+  sig->nops = 0;
+  sig->locus = gimple_location(stmt);
+
+  switch (gimple_code(stmt)) {
+  case GIMPLE_ASSIGN:
+    sig->subcode = gimple_assign_rhs_code(stmt);
+    sig->nops = gimple_num_ops(stmt);
+    for (unsigned j = 1; j < sig->nops; j++) {
+      tree op = gimple_op(stmt, j);
+      codes.add_int(op ? TREE_CODE(op) : ERROR_MARK);
+      // For constants and literals, values must match exactly
+      if (op && CONSTANT_CLASS_P(op)) {
+        inchash::add_expr(op, values);
+        encode_constant(op, &exact);
       }
-      
-      // Compare each non-default variant with the default
-      const function_info &default_info = clone_groups[base_name][default_idx];
-      bool all_same = true;
-      
-      for (size_t i = 0; i < clone_groups[base_name].size(); i++) {
-        if (i == default_idx) continue; // Skip comparing default to itself
-        
-        const function_info &variant_info = clone_groups[base_name][i];
-        
-        if (dump_file) {
-          fprintf(dump_file, "Comparing %s%s with %s%s\n", 
-                  base_name.c_str(), default_info.variant.c_str(),
-                  base_name.c_str(), variant_info.variant.c_str());
-        }
-        
-        bool are_same = compare_functions(default_info.stmts, variant_info.stmts);
-        
-        // If any variant differs from default, mark the group as different
-        if (!are_same) {
-          all_same = false;
-          // Print the pruning decision for this specific variant
-          if (dump_file) {
-            fprintf(dump_file, "NOPRUNE: %s%s\n", base_name.c_str(), variant_info.variant.c_str());
-          }
-        } else {
-          // Print the pruning decision for this specific variant
-          if (dump_file) {
-            fprintf(dump_file, "PRUNE: %s%s\n", base_name.c_str(), variant_info.variant.c_str());
-          }
+    }
+    break;
+
+  case GIMPLE_CALL:
+    {
+      gcall *call = as_a<gcall *>(stmt);
+      tree fn = gimple_call_fn(call);
+      sig->nops = gimple_call_num_args(call);
+      if (!fn) {
+        // Internal function calls have no callee tree
+        codes.add_int(ERROR_MARK);
+        sig->subcode = gimple_call_internal_fn(call);
+      } else {
+        codes.add_int(TREE_CODE(fn));
+        if (TREE_CODE(fn) == ADDR_EXPR) {
+          tree name = DECL_NAME(TREE_OPERAND(fn, 0));
+          values.add_ptr(name);
+          exact_printf(&exact, "%s;", name ? IDENTIFIER_POINTER(name) : "");
         }
       }
-      
-      // Print the overall pruning decision for the default function
-      print_prune_decision(base_name, all_same);
-      
-      // Clear the clone group after making the decision
-      clone_groups.erase(base_name);
     }
+    break;
+
+  case GIMPLE_COND:
+    sig->subcode = gimple_cond_code(as_a<gcond *>(stmt));
+    break;
+
+  case GIMPLE_RETURN:
+    sig->subcode = gimple_return_retval(as_a<greturn *>(stmt)) != NULL_TREE;
+    break;
+
+  default:
+    // For other statement types only the code is compared
+    break;
+  }
+
+  sig->op_codes = codes.end();
+  sig->op_values = values.end();
+  sig->exact = NULL;
+  if (!exact.is_empty()) {
+    exact.safe_push('\0');
+    sig->exact = xstrdup(exact.address());
   }
-  
-  return 0;
 }
 
-} // anonymous namespace
+// Return true if OP refers to a gcov counter, directly or by address
+static bool
+gcov_counter_ref_p(tree op)
+{
+  if (!op)
+    return false;
+  if (TREE_CODE(op) == ADDR_EXPR)
+    op = TREE_OPERAND(op, 0);
+  if (!REFERENCE_CLASS_P(op) && !DECL_P(op))
+    return false;
 
-// Factory function that creates an instance of the pass
-gimple_opt_pass *
-make_pass_kzaw (gcc::context *ctxt)
+  tree base = get_base_address(op);
+  return (base && VAR_P(base) && DECL_ARTIFICIAL(base) && DECL_NAME(base)
+          && startswith(IDENTIFIER_POINTER(DECL_NAME(base)), "__gcov"));
+}
+
+// Return true if STMT was added by profiling or sanitizer instrumentation
+// rather than coming from the source: counter updates and profiler calls
+// from -fprofile-generate, sanitizer checks, and -finstrument-functions
+// hooks.  Statements in the same block using a value that an earlier
+// statement marked with GF_PLF_1 computed, such as the increment between a
+// counter load and store, count too; instrumentation_feed_p covers the
+// statements computing values for instrumentation.
+static bool
+instrumentation_stmt_p(gimple *stmt)
 {
-  return new pass_kzaw (ctxt);
-}
\ No newline at end of file
+  if (gcall *call = dyn_cast<gcall *>(stmt)) {
+    if (gimple_call_internal_p(call)) {
+      switch (gimple_call_internal_fn(call)) {
+      case IFN_ASAN_CHECK:
+      case IFN_ASAN_MARK:
+      case IFN_HWASAN_CHECK:
+      case IFN_HWASAN_MARK:
+      case IFN_UBSAN_NULL:
+      case IFN_UBSAN_BOUNDS:
+      case IFN_UBSAN_VPTR:
+      case IFN_UBSAN_PTR:
+      case IFN_UBSAN_OBJECT_SIZE:
+      case IFN_TSAN_FUNC_EXIT:
+        return true;
+      default:
+        return false;
+      }
+    }
+
+    tree fndecl = gimple_call_fndecl(call);
+    if (fndecl && !gimple_call_lhs(call)) {
+      if (fndecl_built_in_p(fndecl, BUILT_IN_NORMAL)) {
+        built_in_function code = DECL_FUNCTION_CODE(fndecl);
+        if ((code > BEGIN_SANITIZER_BUILTINS && code < END_SANITIZER_BUILTINS)
+            || code == BUILT_IN_PROFILE_FUNC_ENTER
+            || code == BUILT_IN_PROFILE_FUNC_EXIT)
+          return true;
+      } else if (DECL_NAME(fndecl)
+                 && startswith(IDENTIFIER_POINTER(DECL_NAME(fndecl)), "__gcov_")) {
+        return true;
+      }
+    }
+  }
+
+  // Counter loads, increments and stores, including atomic updates
+  for (unsigned i = 0; i < gimple_num_ops(stmt); i++)
+    if (gcov_counter_ref_p(gimple_op(stmt, i)))
+      return true;
+
+  if (!gimple_in_ssa_p(cfun))
+    return false;
+
+  ssa_op_iter iter;
+  tree use;
+  basic_block bb = gimple_bb(stmt);
+  FOR_EACH_SSA_TREE_OPERAND(use, stmt, iter, SSA_OP_USE) {
+    gimple *def = SSA_NAME_DEF_STMT(use);
+    if (gimple_bb(def) == bb && gimple_code(def) != GIMPLE_PHI
+        && gimple_plf(def, GF_PLF_1))
+      return true;
+  }
+  return false;
+}
+
+// Return true if STMT only computes a value for statements marked with
+// GF_PLF_1, like the address &a[i] passed to .ASAN_CHECK or the
+// __builtin_return_address result passed to __tsan_func_entry
+static bool
+instrumentation_feed_p(gimple *stmt)
+{
+  if (gimple_has_side_effects(stmt) || gimple_vdef(stmt))
+    return false;
+  tree lhs = gimple_get_lhs(stmt);
+  if (!lhs || TREE_CODE(lhs) != SSA_NAME)
+    return false;
+
+  bool used = false;
+  imm_use_iterator iter;
+  use_operand_p use_p;
+  FOR_EACH_IMM_USE_FAST(use_p, iter, lhs) {
+    gimple *use = USE_STMT(use_p);
+    if (is_gimple_debug(use))
+      continue;
+    if (gimple_code(use) == GIMPLE_PHI || !gimple_plf(use, GF_PLF_1))
+      return false;
+    used = true;
+  }
+  return used;
+}
+
+// Return true if STMT is left out of the comparison: debug statements,
+// nops, labels and predictions, which differ with -g or between clones
+// without changing the code, and instrumentation marked with GF_PLF_1
+static bool
+ignored_stmt_p(gimple *stmt)
+{
+  switch (gimple_code(stmt)) {
+  case GIMPLE_DEBUG:
+  case GIMPLE_NOP:
+  case GIMPLE_LABEL:
+  case GIMPLE_PREDICT:
+    return true;
+  default:
+    return gimple_plf(stmt, GF_PLF_1);
+  }
+}
+
+// A block being put in canonical order by collect_block_canonical
+struct block_order
+{
+  auto_vec<stmt_sig, 32> sigs;       // Signature of each statement
+  auto_vec<unsigned, 64> operands;   // Statement defining each SSA operand,
+                                     // or -1U if it is not in the block
+  auto_vec<unsigned, 32> op_first;   // Statement I's operands start at
+                                     // operands[op_first[I]]
+  auto_vec<unsigned, 32> emitted;    // Canonical position of each statement
+                                     // already emitted
+};
+
+// Return true if statement IA comes before IB in the canonical order.
+// Signatures decide.  Between identical signatures the statement whose
+// operands were emitted earlier comes first, which holds in every clone
+// however the target scheduled the block.  Only when the operands come from
+// outside the block too does the index decide, and then clones that order
+// such statements differently are still reported as NOPRUNE.
+static bool
+stmt_sig_less(const block_order &order, unsigned ia, unsigned ib)
+{
+  const stmt_sig &a = order.sigs[ia], &b = order.sigs[ib];
+  if (a.code != b.code)
+    return a.code < b.code;
+  if (a.subcode != b.subcode)
+    return a.subcode < b.subcode;
+  if (a.nops != b.nops)
+    return a.nops < b.nops;
+  if (a.op_codes != b.op_codes)
+    return a.op_codes < b.op_codes;
+  if (a.op_values != b.op_values)
+    return a.op_values < b.op_values;
+  if (!stmt_exact_equal(a, b))
+    return strcmp(a.exact ? a.exact : "", b.exact ? b.exact : "") < 0;
+
+  // Every operand defined in the block has been emitted by the time a
+  // statement is ready
+  unsigned na = order.op_first[ia + 1] - order.op_first[ia];
+  unsigned nb = order.op_first[ib + 1] - order.op_first[ib];
+  for (unsigned k = 0; k < MIN(na, nb); k++) {
+    unsigned da = order.operands[order.op_first[ia] + k];
+    unsigned db = order.operands[order.op_first[ib] + k];
+    unsigned pa = da == -1U ? -1U : order.emitted[da];
+    unsigned pb = db == -1U ? -1U : order.emitted[db];
+    if (pa != pb)
+      return pa < pb;
+  }
+  if (na != nb)
+    return na < nb;
+  return ia < ib;
+}
+
+// Binary min-heap of statement indices, ordered by stmt_sig_less
+static void
+ready_push(vec<unsigned> &heap, const block_order &order, unsigned idx)
+{
+  unsigned pos = heap.length();
+  heap.safe_push(idx);
+  while (pos > 0) {
+    unsigned parent = (pos - 1) / 2;
+    if (!stmt_sig_less(order, heap[pos], heap[parent]))
+      break;
+    std::swap(heap[pos], heap[parent]);
+    pos = parent;
+  }
+}
+
+static unsigned
+ready_pop(vec<unsigned> &heap, const block_order &order)
+{
+  unsigned top = heap[0];
+  heap[0] = heap.last();
+  heap.pop();
+
+  unsigned pos = 0, n = heap.length();
+  for (;;) {
+    unsigned least = pos, l = 2 * pos + 1, r = l + 1;
+    if (l < n && stmt_sig_less(order, heap[l], heap[least]))
+      least = l;
+    if (r < n && stmt_sig_less(order, heap[r], heap[least]))
+      least = r;
+    if (least == pos)
+      break;
+    std::swap(heap[pos], heap[least]);
+    pos = least;
+  }
+  return top;
+}
+
+// A dependence between two statements of one block: FROM must come first
+struct stmt_dep
+{
+  unsigned from, to;
+};
+
+// Append the signatures of BB's statements to STMTS in canonical order: a
+// topological order of the block's dependence graph that always takes the
+// ready statement stmt_sig_less puts first.  The graph holds SSA def-use
+// edges, memory order through the virtual operands, and barriers (control
+// statements, volatile or side-effecting statements) that nothing crosses.
+// Ignored statements are not part of the graph.  Edges are linear in the
+// block size, so ordering costs O(n log n).
+static void
+collect_block_canonical(basic_block bb, vec<stmt_sig> *stmts)
+{
+  const unsigned none = -1U;
+  auto_vec<gimple *, 32> body;
+  block_order order;
+  auto_vec<stmt_dep, 64> deps;
+  auto_vec<unsigned, 16> loads;
+  unsigned last_store = none, last_barrier = none;
+
+  for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+    gimple *stmt = gsi_stmt(gsi);
+    if (ignored_stmt_p(stmt)) {
+      gimple_set_uid(stmt, none);
+      continue;
+    }
+    gimple_set_uid(stmt, body.length());
+    body.safe_push(stmt);
+  }
+  unsigned n = body.length();
+  if (!n)
+    return;
+
+  order.sigs.safe_grow(n);
+  order.op_first.reserve(n + 1);
+  order.emitted.safe_grow(n);
+
+  for (unsigned i = 0; i < n; i++) {
+    gimple *stmt = body[i];
+    encode_statement(stmt, &order.sigs[i]);
+
+    // Data dependences on values computed earlier in the block
+    ssa_op_iter iter;
+    tree use;
+    order.op_first.quick_push(order.operands.length());
+    FOR_EACH_SSA_TREE_OPERAND(use, stmt, iter, SSA_OP_USE) {
+      gimple *def = SSA_NAME_DEF_STMT(use);
+      if (gimple_bb(def) == bb && gimple_code(def) != GIMPLE_PHI
+          && gimple_uid(def) != none) {
+        deps.safe_push({gimple_uid(def), i});
+        order.operands.safe_push(gimple_uid(def));
+      } else {
+        order.operands.safe_push(none);
+      }
+    }
+
+    // Stores stay ordered with every other memory access, loads only
+    // with stores
+    if (gimple_vdef(stmt)) {
+      if (last_store != none)
+        deps.safe_push({last_store, i});
+      for (unsigned j = 0; j < loads.length(); j++)
+        deps.safe_push({loads[j], i});
+      loads.truncate(0);
+      last_store = i;
+    } else if (gimple_vuse(stmt)) {
+      if (last_store != none)
+        deps.safe_push({last_store, i});
+      loads.safe_push(i);
+    }
+
+    // Barriers follow everything since the previous barrier and precede
+    // everything after them
+    if (last_barrier != none)
+      deps.safe_push({last_barrier, i});
+    if (is_ctrl_stmt(stmt)
+        || gimple_code(stmt) == GIMPLE_ASM
+        || gimple_has_volatile_ops(stmt)
+        || (is_gimple_call(stmt) && gimple_has_side_effects(stmt))) {
+      for (unsigned j = last_barrier == none ? 0 : last_barrier + 1; j < i; j++)
+        deps.safe_push({j, i});
+      last_barrier = i;
+    }
+  }
+
+  order.op_first.quick_push(order.operands.length());
+
+  // Successor lists in compressed form, and the number of unmet dependences
+  auto_vec<unsigned, 32> first, succs, waiting;
+  first.safe_grow_cleared(n + 1);
+  waiting.safe_grow_cleared(n);
+  succs.safe_grow(deps.length());
+  for (unsigned e = 0; e < deps.length(); e++) {
+    first[deps[e].from + 1]++;
+    waiting[deps[e].to]++;
+  }
+  for (unsigned i = 0; i < n; i++)
+    first[i + 1] += first[i];
+  auto_vec<unsigned, 32> fill;
+  fill.safe_splice(first);
+  for (unsigned e = 0; e < deps.length(); e++)
+    succs[fill[deps[e].from]++] = deps[e].to;
+
+  auto_vec<unsigned, 32> ready;
+  for (unsigned i = 0; i < n; i++)
+    if (!waiting[i])
+      ready_push(ready, order, i);
+
+  unsigned emitted = 0;
+  while (!ready.is_empty()) {
+    unsigned i = ready_pop(ready, order);
+    order.emitted[i] = emitted++;
+    stmts->quick_push(order.sigs[i]);
+    for (unsigned e = first[i]; e < first[i + 1]; e++)
+      if (--waiting[succs[e]] == 0)
+        ready_push(ready, order, succs[e]);
+  }
+}
+
+// Check if a function is a member of a version group.  Membership comes
+// from the cgraph function-version chain that pass_target_clone and the
+// front ends build, so cgraph clones of a version (.constprop, .isra,
+// .part) are not members, and target mangling such as AArch64's "._M"
+// never matters.  GROUP_UID identifies the group and BASE_NAME names it.
+bool
+pass_kzaw::is_clone_function(tree decl, int *group_uid, tree *base_name,
+                             clone_variant_kind *kind, tree *variant)
+{
+  // Functions being explored carry their group in an attribute
+  tree explore = lookup_attribute(KZAW_EXPLORE_ATTR, DECL_ATTRIBUTES(decl));
+  if (explore) {
+    tree args = TREE_VALUE(explore);
+    tree original = decl;
+    if (TREE_CODE(TREE_VALUE(args)) == STRING_CST) {
+      const char *target = TREE_STRING_POINTER(TREE_VALUE(args));
+      original = TREE_VALUE(TREE_CHAIN(args));
+      *variant = get_identifier(ACONCAT((".", target, NULL)));
+      *kind = CLONE_VARIANT_EXPLORE;
+    } else {
+      *variant = get_identifier(".default");
+      *kind = CLONE_VARIANT_DEFAULT;
+    }
+    cgraph_node *original_node = cgraph_node::get(original);
+    if (!original_node)
+      return false;
+    *group_uid = original_node->get_uid();
+    *base_name = DECL_NAME(original);
+
+    if (dump_file) {
+      fprintf(dump_file, "Found explored function: %s (base: %s, variant: %s)\n",
+              IDENTIFIER_POINTER(DECL_NAME(decl)), IDENTIFIER_POINTER(*base_name),
+              IDENTIFIER_POINTER(*variant));
+    }
+    return true;
+  }
+
+  cgraph_node *node = cgraph_node::get(decl);
+  cgraph_function_version_info *first = node ? first_version(node) : NULL;
+  if (!first || !first->next)
+    return false;
+
+  // In a target_clones group the first version is the default, which keeps
+  // the plain source name; front-end versions all share their DECL_NAME
+  *group_uid = first->this_node->get_uid();
+  *base_name = DECL_NAME(first->this_node->decl);
+  *kind = is_function_default_version(decl)
+          ? CLONE_VARIANT_DEFAULT : CLONE_VARIANT_TARGET;
+  *variant = version_suffix(decl);
+
+  if (dump_file) {
+    fprintf(dump_file, "Found function version: %s (base: %s, variant: %s)\n",
+            node->dump_name(), IDENTIFIER_POINTER(*base_name),
+            IDENTIFIER_POINTER(*variant));
+  }
+  return true;
+}
+
+// Collect signatures of all statements in a function
+void
+pass_kzaw::collect_function_statements(function *fun, vec<stmt_sig> *stmts)
+{
+  basic_block bb;
+
+  // Mark instrumentation.  Blocks are walked in order, so the definitions
+  // instrumentation_stmt_p looks at are already marked.
+  FOR_EACH_BB_FN(bb, fun) {
+    for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi))
+      gimple_set_plf(gsi_stmt(gsi), GF_PLF_1, instrumentation_stmt_p(gsi_stmt(gsi)));
+  }
+
+  // Then mark what only feeds it, walking backwards so a chain of such
+  // statements is marked from its last use.  A chain running through blocks
+  // the walk meets in the wrong order takes another round.
+  if (gimple_in_ssa_p(fun)) {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      FOR_EACH_BB_REVERSE_FN(bb, fun) {
+        for (gimple_stmt_iterator gsi = gsi_last_bb(bb); !gsi_end_p(gsi); gsi_prev(&gsi)) {
+          gimple *stmt = gsi_stmt(gsi);
+          if (!gimple_plf(stmt, GF_PLF_1) && instrumentation_feed_p(stmt)) {
+            gimple_set_plf(stmt, GF_PLF_1, true);
+            changed = true;
+          }
+        }
+      }
+    }
+  }
+
+  // Size the vector for the statements that are kept, so collection does
+  // not reallocate
+  unsigned count = 0;
+  FOR_EACH_BB_FN(bb, fun) {
+    for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi))
+      if (!ignored_stmt_p(gsi_stmt(gsi)))
+        count++;
+  }
+  stmts->create(count);
+
+  // Collect all statements in the function.  In SSA form each block is
+  // put in canonical order first, so target-dependent scheduling of
+  // independent statements does not show up as a difference.
+  bool canonical = gimple_in_ssa_p(fun);
+  FOR_EACH_BB_FN(bb, fun) {
+    if (canonical) {
+      collect_block_canonical(bb, stmts);
+      continue;
+    }
+    for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+      if (ignored_stmt_p(gsi_stmt(gsi)))
+        continue;
+      stmt_sig sig;
+      encode_statement(gsi_stmt(gsi), &sig);
+      stmts->quick_push(sig);
+    }
+  }
+
+  if (dump_file) {
+    fprintf(dump_file, "Collected %u statements from function %s\n",
+            stmts->length(), function_name(fun));
+  }
+}
+
+// Compare two functions for substantial similarity.  When they differ,
+// REASON describes the first divergence and WHERE is the index of the
+// statement in FUNC2_STMTS it was found at.
+bool
+pass_kzaw::compare_functions(const vec<stmt_sig> &func1_stmts,
+                             const vec<stmt_sig> &func2_stmts,
+                             const char **reason, unsigned *where)
+{
+  // First check: different statement count means different functions
+  if (func1_stmts.length() != func2_stmts.length()) {
+    *reason = "Different statement counts";
+    *where = MIN(func1_stmts.length(), func2_stmts.length());
+    if (dump_file) {
+      fprintf(dump_file, "Functions have different statement counts: %u vs %u\n",
+              func1_stmts.length(), func2_stmts.length());
+    }
+    return false;
+  }
+
+  // Iterate through statements and compare them
+  for (unsigned i = 0; i < func1_stmts.length(); i++) {
+    const stmt_sig &stmt1 = func1_stmts[i];
+    const stmt_sig &stmt2 = func2_stmts[i];
+
+    // Check if statement codes are different
+    *where = i;
+    if (stmt1.code != stmt2.code) {
+      *reason = "Different gimple codes";
+      if (dump_file) {
+        fprintf(dump_file, "Statement %u: Different gimple codes (%d vs %d)\n",
+                i, stmt1.code, stmt2.code);
+      }
+      return false;
+    }
+
+    // Compare based on statement type
+    *reason = NULL;
+    switch (stmt1.code) {
+    case GIMPLE_ASSIGN:
+      if (stmt1.subcode != stmt2.subcode)
+        *reason = "Assignment operation mismatch";
+      else if (stmt1.nops != stmt2.nops)
+        *reason = "Different number of operands";
+      else if (stmt1.op_codes != stmt2.op_codes)
+        *reason = "Different operand types";
+      else if (stmt1.op_values != stmt2.op_values
+               || !stmt_exact_equal(stmt1, stmt2))
+        *reason = "Different constant values";
+      break;
+
+    case GIMPLE_CALL:
+      if (stmt1.op_codes != stmt2.op_codes)
+        *reason = "Different function call types";
+      else if (stmt1.subcode != stmt2.subcode
+               || stmt1.op_values != stmt2.op_values
+               || !stmt_exact_equal(stmt1, stmt2))
+        *reason = "Calling different functions";
+      else if (stmt1.nops != stmt2.nops)
+        *reason = "Different number of arguments in call";
+      break;
+
+    case GIMPLE_COND:
+      if (stmt1.subcode != stmt2.subcode)
+        *reason = "Different conditional codes";
+      break;
+
+    case GIMPLE_RETURN:
+      if (stmt1.subcode != stmt2.subcode)
+        *reason = "One function returns a value, the other doesn't";
+      break;
+
+    default:
+      // For other statement types, we consider them the same if the code matches
+      break;
+    }
+
+    if (*reason) {
+      if (dump_file) {
+        fprintf(dump_file, "%s at statement %u\n", *reason, i);
+      }
+      return false;
+    }
+  }
+
+  // If we've made it this far, the functions are considered substantially the same
+  if (dump_file) {
+    fprintf(dump_file, "Functions are substantially the same\n");
+  }
+  return true;
+}
+
+// Print the pruning decision
+void
+pass_kzaw::print_prune_decision(const char *base_name, bool should_prune)
+{
+  if (dump_file) {
+    if (should_prune) {
+      fprintf(dump_file, "PRUNE: %s\n", base_name);
+    } else {
+      fprintf(dump_file, "NOPRUNE: %s\n", base_name);
+    }
+  }
+}
+
+// Report how far an explore clone differs from the default.
+// Returns true if the candidate target produced distinct code.
+bool
+pass_kzaw::report_explore(const char *base, const function_info &default_info,
+                          const function_info &variant_info)
+{
+  const char *target = variant_info.variant + 1;
+  unsigned diffs = count_differences(default_info.stmts, variant_info.stmts);
+
+  if (dump_file) {
+    fprintf(dump_file, "EXPLORE: %s%s %s (%u vs %u statements, %u differ)\n",
+            base, variant_info.variant,
+            diffs ? "distinct" : "identical", default_info.stmts.length(),
+            variant_info.stmts.length(), diffs);
+  }
+
+  if (diffs)
+    inform(default_info.locus,
+           "%qs: target %qs produces distinct code (%u vs %u statements, %u differ)",
+           base, target, default_info.stmts.length(),
+           variant_info.stmts.length(), diffs);
+  else
+    inform(default_info.locus, "%qs: target %qs produces identical code",
+           base, target);
+  return diffs != 0;
+}
+
+// Compare every variant of a group against its default and report
+void
+pass_kzaw::analyze_group(clone_group &group)
+{
+  const char *base = group.base_name;
+
+  if (dump_file) {
+    fprintf(dump_file, "Analyzing clones of function: %s\n", base);
+  }
+
+  // Find the default variant to use as reference
+  unsigned default_idx = 0;
+  for (unsigned i = 0; i < group.members.length(); i++) {
+    if (group.members[i].kind == CLONE_VARIANT_DEFAULT) {
+      default_idx = i;
+      break;
+    }
+  }
+
+  // Compare each non-default variant with the default
+  const function_info &default_info = group.members[default_idx];
+  bool all_same = true;
+  unsigned targets = 0, explored = 0, distinct = 0;
+
+  for (unsigned i = 0; i < group.members.length(); i++) {
+    if (i == default_idx) continue; // Skip comparing default to itself
+
+    const function_info &variant_info = group.members[i];
+    const char *variant = variant_info.variant;
+
+    // Explore clones are only measured, never pruned
+    if (variant_info.kind == CLONE_VARIANT_EXPLORE) {
+      explored++;
+      if (report_explore(base, default_info, variant_info))
+        distinct++;
+      continue;
+    }
+    targets++;
+
+    if (dump_file) {
+      fprintf(dump_file, "Comparing %s%s with %s%s\n",
+              base, default_info.variant, base, variant);
+    }
+
+    const char *reason;
+    unsigned where;
+    bool are_same = compare_functions(default_info.stmts, variant_info.stmts,
+                                      &reason, &where);
+
+    // If any variant differs from default, mark the group as different
+    if (!are_same) {
+      all_same = false;
+    }
+
+    // Print the pruning decision for this specific variant
+    if (dump_file) {
+      fprintf(dump_file, "%s: %s%s\n", are_same ? "PRUNE" : "NOPRUNE",
+              base, variant);
+    }
+
+    // Later builds of the same body need not create it again, if the RTL
+    // agrees by the end of the unit
+    if (are_same && group.fingerprint && variant_info.target)
+      record_manifest_decision(group.manifest_key, variant_info.target,
+                               group.fingerprint, default_info.uid,
+                               variant_info.uid);
+
+    // Report it with the other optimization remarks, at the first
+    // divergent statement of the variant when there is one
+    if (dump_enabled_p()) {
+      location_t locus = variant_info.locus;
+      if (!are_same && where < variant_info.stmts.length()
+          && variant_info.stmts[where].locus != UNKNOWN_LOCATION)
+        locus = variant_info.stmts[where].locus;
+      dump_user_location_t loc = dump_user_location_t::from_location_t(locus);
+
+      if (are_same)
+        dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, loc,
+                        "clone %s%s is identical to the default and can be pruned\n",
+                        base, variant);
+      else
+        dump_printf_loc(MSG_MISSED_OPTIMIZATION, loc,
+                        "clone %s%s kept: %s at statement %u\n",
+                        base, variant, reason, where);
+    }
+
+    // An automatic clone whose loops did not change was a wrong guess
+    if (are_same && group.automatic)
+      inform(default_info.locus,
+             "automatic clone %<%s%s%> is identical to the default", base, variant);
+  }
+
+  // Print the overall pruning decision for the default function
+  if (targets || !explored)
+    print_prune_decision(group.base_name, all_same);
+
+  if (explored && dump_file) {
+    fprintf(dump_file, "EXPLORE: %s: %u of %u targets distinct\n",
+            base, distinct, explored);
+  }
+}
+
+// Free the statement signatures and names held by a group
+void
+pass_kzaw::release_group(clone_group &group)
+{
+  for (unsigned i = 0; i < group.members.length(); i++) {
+    for (unsigned j = 0; j < group.members[i].stmts.length(); j++)
+      free(group.members[i].stmts[j].exact);
+    group.members[i].stmts.release();
+    free(group.members[i].variant);
+    free(group.members[i].target);
+  }
+  group.members.release();
+  free(group.base_name);
+  free(group.manifest_key);
+  free(group.fingerprint);
+}
+
+// Report and release groups that never saw all of their members, which
+// finish_unit does once the last function of the unit has been expanded
+void
+pass_kzaw::flush_clone_groups()
+{
+  if (clone_groups.is_empty())
+    return;
+
+  if (dump_file) {
+    fprintf(dump_file, "End of unit: %zu incomplete clone groups\n",
+            clone_groups.elements());
+  }
+
+  for (hash_map<group_key, clone_group>::iterator it = clone_groups.begin();
+       it != clone_groups.end(); ++it) {
+    clone_group &group = (*it).second;
+    const char *base_name = group.base_name;
+
+    if (dump_file) {
+      fprintf(dump_file, "Incomplete group %s: %u of %u members seen\n",
+              base_name, group.members.length(),
+              group.expected);
+    }
+
+    // Decide on whatever was seen; a lone member has nothing to compare to
+    if (group.members.length() >= 2)
+      analyze_group(group);
+    else
+      print_prune_decision(base_name, false);
+
+    release_group(group);
+  }
+  clone_groups.empty();
+}
+
+// Report the groups still open once the whole unit has been compiled, in
+// the pass's dump, then record the decisions whose RTL agreed and write
+// back the decision manifest.  pass_kzaw_rtl calls this from the last
+// function of the unit, with its own dump open.  Everything kept across
+// functions is released, so nothing of the unit lives on until exit.
+void
+pass_kzaw::finish_unit()
+{
+  if (!clone_groups.is_empty() || !pending_decisions.is_empty()) {
+    FILE *rtl_dump = dump_file;
+    dump_file = dump_begin(static_pass_number, NULL);
+    flush_clone_groups();
+    confirm_manifest_decisions();
+    if (dump_file)
+      dump_end(static_pass_number, dump_file);
+    dump_file = rtl_dump;
+  }
+
+  if (manifest_changed)
+    write_decision_manifest();
+  release_manifest_entries();
+
+  delete rtl_fingerprints;
+  rtl_fingerprints = NULL;
+}
+
+// Return the counter block of variant FNDECL, creating it on first use
+tree
+pass_kzaw::get_counter_block(tree fndecl)
+{
+  bool existed;
+  tree &block = counter_blocks.get_or_insert(fndecl, &existed);
+  if (existed)
+    return block;
+
+  tree type = build_array_type_nelts(pointer_sized_int_node, KZAW_COUNTER_WORDS);
+  block = build_decl(BUILTINS_LOCATION, VAR_DECL,
+                     create_tmp_var_name("kzaw_counter"), type);
+  TREE_STATIC(block) = 1;
+  TREE_ADDRESSABLE(block) = 1;
+  DECL_ARTIFICIAL(block) = 1;
+  DECL_IGNORED_P(block) = 1;
+  DECL_PRESERVE_P(block) = 1;
+
+  // Blocks are cache-line sized and aligned so the section is a plain array
+  SET_DECL_ALIGN(block, KZAW_COUNTER_STRIDE * POINTER_SIZE);
+  DECL_USER_ALIGN(block) = 1;
+  set_decl_section_name(block, KZAW_COUNTER_SECTION);
+
+  // Only the name word is initialized; the counters start at zero
+  const char *name = IDENTIFIER_POINTER(DECL_ASSEMBLER_NAME(fndecl));
+  tree name_addr = build_string_literal(strlen(name) + 1, name);
+  vec<constructor_elt, va_gc> *elts = NULL;
+  CONSTRUCTOR_APPEND_ELT(elts, size_int(KZAW_COUNTER_NAME),
+                         fold_convert(pointer_sized_int_node, name_addr));
+  DECL_INITIAL(block) = build_constructor(type, elts);
+
+  varpool_node::finalize_decl(block);
+  return block;
+}
+
+// Build the store the resolver makes when it selects FNDECL.  Resolvers run
+// while relocations are being processed, so this must not call the runtime.
+gimple *
+pass_kzaw::build_selection_store(tree fndecl)
+{
+  tree ref = build4(ARRAY_REF, pointer_sized_int_node, get_counter_block(fndecl),
+                    size_int(KZAW_COUNTER_SELECTED), NULL_TREE, NULL_TREE);
+  return gimple_build_assign(ref, build_one_cst(pointer_sized_int_node));
+}
+
+// Count calls to the current variant on entry
+void
+pass_kzaw::instrument_clone(function *fun)
+{
+  if (!counter_enter_fn) {
+    tree fntype = build_function_type_list(void_type_node, ptr_type_node,
+                                           NULL_TREE);
+    counter_enter_fn = build_fn_decl("__kzaw_clone_enter", fntype);
+    TREE_NOTHROW(counter_enter_fn) = 1;
+  }
+
+  tree block = get_counter_block(fun->decl);
+  gcall *call = gimple_build_call(counter_enter_fn, 1,
+                                  build_fold_addr_expr_with_type(block, ptr_type_node));
+
+  // Insert on the entry edge so a loop header at entry is not counted per iteration
+  gsi_insert_on_edge_immediate(single_succ_edge(ENTRY_BLOCK_PTR_FOR_FN(fun)), call);
+
+  if (dump_file) {
+    fprintf(dump_file, "Instrumented variant %s\n", function_name(fun));
+  }
+}
+
+// Record which variant the resolver returns
+void
+pass_kzaw::instrument_resolver(function *fun)
+{
+  basic_block bb;
+
+  FOR_EACH_BB_FN(bb, fun) {
+    gimple_stmt_iterator gsi = gsi_last_bb(bb);
+    if (gsi_end_p(gsi))
+      continue;
+    greturn *ret = dyn_cast<greturn *>(gsi_stmt(gsi));
+    if (!ret || !gimple_return_retval(ret))
+      continue;
+    tree val = gimple_return_retval(ret);
+
+    // A merged return selects the variant on each incoming edge
+    if (TREE_CODE(val) == SSA_NAME) {
+      if (gphi *phi = dyn_cast<gphi *>(SSA_NAME_DEF_STMT(val))) {
+        for (unsigned i = 0; i < gimple_phi_num_args(phi); i++) {
+          tree variant = address_of_function(gimple_phi_arg_def(phi, i));
+          if (variant)
+            gsi_insert_on_edge(gimple_phi_arg_edge(phi, i),
+                               build_selection_store(variant));
+        }
+        continue;
+      }
+    }
+
+    // Before SSA the address goes through the resolver's result variable
+    if (VAR_P(val)) {
+      for (gimple_stmt_iterator prev = gsi; !gsi_end_p(prev); gsi_prev(&prev)) {
+        gimple *stmt = gsi_stmt(prev);
+        if (is_gimple_assign(stmt) && gimple_assign_lhs(stmt) == val) {
+          val = gimple_assign_rhs1(stmt);
+          break;
+        }
+      }
+    }
+
+    tree variant = address_of_function(val);
+    if (variant)
+      gsi_insert_before(&gsi, build_selection_store(variant), GSI_SAME_STMT);
+  }
+
+  gsi_commit_edge_inserts();
+
+  if (dump_file) {
+    fprintf(dump_file, "Instrumented resolver %s\n", function_name(fun));
+  }
+}
+
+// Main execution function for the pass
+unsigned int
+pass_kzaw::execute(function *fun)
+{
+  // Get the function declaration
+  tree fndecl = current_function_decl;
+
+  // Skip external functions or those with no body
+  if (!fndecl || DECL_EXTERNAL(fndecl) || !DECL_STRUCT_FUNCTION(fndecl)) {
+    return 0;
+  }
+
+  unsigned int todo = 0;
+  bool instrumented = false, rewritten = false;
+
+  // Check if this is a clone function or a default function with clones
+  tree base_name, variant;
+  clone_variant_kind kind;
+  int group_uid;
+  bool is_clone_or_default = is_clone_function(fndecl, &group_uid, &base_name,
+                                               &kind, &variant);
+
+  // With -fkzaw-dump-clones-only, everything outside a clone group is kept
+  // out of the dump, including the body the pass manager writes afterwards
+  bool hide_dump = (flag_kzaw_dump_clones_only && !is_clone_or_default
+                    && !is_resolver_function(fndecl));
+  if (hide_dump)
+    dump_file = NULL;
+
+  if (!is_clone_or_default) {
+    if (dump_file)
+      fprintf(dump_file, "NOPRUNE: %s\n", IDENTIFIER_POINTER(DECL_NAME(fndecl)));
+    report_dropped_variants(fndecl, IDENTIFIER_POINTER(DECL_NAME(fndecl)));
+
+    if (flag_kzaw_instrument_clones && is_resolver_function(fndecl)) {
+      instrument_resolver(fun);
+      instrumented = true;
+    }
+  } else {
+    // Collect statements in this function
+    function_info info;
+    info.uid = cgraph_node::get(fndecl)->get_uid();
+    info.locus = DECL_SOURCE_LOCATION(fndecl);
+    info.kind = kind;
+    info.variant = xstrdup(IDENTIFIER_POINTER(variant));
+    info.target = NULL;
+    if (kind == CLONE_VARIANT_TARGET && version_target(fndecl))
+      info.target = xstrdup(version_target(fndecl));
+    collect_function_statements(fun, &info.stmts);
+
+    // Explore clones shrink to stubs once their statements are collected
+    if (kind == CLONE_VARIANT_EXPLORE) {
+      discard_function_body(fun);
+      todo |= TODO_cleanup_cfg;
+    }
+
+    // A default no host of the fleet selects only has to forward calls
+    // that reach it directly, once it has been compared
+    if (kind == CLONE_VARIANT_DEFAULT && fleet_fallback(fun)) {
+      todo |= TODO_cleanup_cfg;
+      rewritten = true;
+    }
+
+    // Instrument after collecting so the counter call is not compared
+    if (flag_kzaw_instrument_clones && kind != CLONE_VARIANT_EXPLORE) {
+      instrument_clone(fun);
+      instrumented = true;
+    }
+
+    // Add to the appropriate clone group
+    bool existed;
+    clone_group &group = clone_groups.get_or_insert(group_uid, &existed);
+    if (!existed) {
+      group.base_name = xstrdup(IDENTIFIER_POINTER(base_name));
+      group.expected = 0;
+      group.automatic = false;
+      group.manifest_key = group.fingerprint = NULL;
+      group.members = vNULL;
+    }
+    tree fingerprint = lookup_attribute(KZAW_FINGERPRINT_ATTR, DECL_ATTRIBUTES(fndecl));
+    if (fingerprint && kind == CLONE_VARIANT_DEFAULT && !group.fingerprint) {
+      tree args = TREE_VALUE(fingerprint);
+      group.manifest_key = xstrdup(TREE_STRING_POINTER(TREE_VALUE(args)));
+      group.fingerprint = xstrdup(TREE_STRING_POINTER(TREE_VALUE(TREE_CHAIN(args))));
+    }
+    if (!group.expected)
+      group.expected = count_clone_targets(fndecl);
+    if (lookup_attribute(KZAW_AUTO_ATTR, DECL_ATTRIBUTES(fndecl)))
+      group.automatic = true;
+    group.members.safe_push(info);
+
+    if (info.kind == CLONE_VARIANT_DEFAULT && group.members.length() == 1) {
+      if (dump_file)
+        fprintf(dump_file, "NOPRUNE: %s%s\n",
+                IDENTIFIER_POINTER(base_name), IDENTIFIER_POINTER(variant));
+    }
+    if (info.kind == CLONE_VARIANT_DEFAULT)
+      report_dropped_variants(fndecl, IDENTIFIER_POINTER(base_name));
+
+    // Decide once every listed target has been seen; without the
+    // attribute to go by, decide as soon as there is a pair
+    unsigned seen = group.members.length();
+    if (group.expected ? seen >= group.expected : seen >= 2) {
+      analyze_group(group);
+
+      // Clear the clone group after making the decision
+      release_group(group);
+      clone_groups.remove(group_uid);
+    }
+  }
+
+  if (instrumented || rewritten) {
+    if (gimple_in_ssa_p(fun)) {
+      mark_virtual_operands_for_renaming(fun);
+      todo |= TODO_update_ssa_only_virtuals;
+    }
+    cgraph_edge::rebuild_edges();
+  }
+
+  return todo;
+}
+
+// IPA pass behind -fkzaw-explore-isa.  Runs right after pass_target_clone
+// and gives each selected function one clone per candidate target; the kzaw
+// pass then compares them with the original and empties them.
+const pass_data pass_data_ipa_kzaw_explore =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-explore", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_explore : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_explore (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_explore, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return flag_kzaw_explore_isa != NULL;
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// Return true if NAME is one of the entries of comma-separated LIST
+static bool
+name_in_list_p(const char *name, const char *list)
+{
+  size_t len = strlen(name);
+  for (const char *p = list; *p; ) {
+    const char *end = strchr(p, ',');
+    size_t entry = end ? (size_t) (end - p) : strlen(p);
+    if (entry == len && strncmp(p, name, len) == 0)
+      return true;
+    if (!end)
+      break;
+    p = end + 1;
+  }
+  return false;
+}
+
+// Check if NODE should be cloned for exploration
+static bool
+explore_function_p(cgraph_node *node)
+{
+  tree decl = node->decl;
+
+  if (!node->definition || node->alias || node->thunk || node->inlined_to)
+    return false;
+
+  // Functions that are already multiversioned have their own groups
+  if (DECL_FUNCTION_VERSIONED(decl)
+      || lookup_attribute("target_clones", DECL_ATTRIBUTES(decl))
+      || lookup_attribute("target", DECL_ATTRIBUTES(decl))
+      || lookup_attribute("target_version", DECL_ATTRIBUTES(decl)))
+    return false;
+
+  return (!flag_kzaw_explore_functions
+          || name_in_list_p(IDENTIFIER_POINTER(DECL_NAME(decl)),
+                            flag_kzaw_explore_functions));
+}
+
+unsigned int
+pass_ipa_kzaw_explore::execute(function *)
+{
+  cgraph_node *node;
+  auto_vec<cgraph_node *> nodes;
+
+  // Pick the functions first, since cloning adds nodes to the callgraph
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+    if (explore_function_p(node))
+      nodes.safe_push(node);
+  }
+
+  tree explore_id = get_identifier(KZAW_EXPLORE_ATTR);
+
+  for (unsigned i = 0; i < nodes.length(); i++) {
+    node = nodes[i];
+    unsigned created = 0;
+
+    for (const char *p = flag_kzaw_explore_isa; *p; ) {
+      const char *end = strchr(p, ',');
+      char *target = xstrndup(p, end ? (size_t) (end - p) : strlen(p));
+      p = end ? end + 1 : p + strlen(p);
+      if (!*target) {
+        free(target);
+        continue;
+      }
+
+      // Clone suffix: the target with anything but letters and digits
+      // replaced, as pass_target_clone does
+      char *suffix = concat("kzaw_explore_", target, NULL);
+      for (char *c = suffix; *c; c++)
+        if (!ISALNUM(*c))
+          *c = '_';
+
+      // The target attribute must come first for valid_attribute_p
+      tree args = tree_cons(NULL_TREE, build_string(strlen(target) + 1, target),
+                            build_tree_list(NULL_TREE, node->decl));
+      tree attributes = tree_cons(explore_id, args, DECL_ATTRIBUTES(node->decl));
+      attributes = make_attribute("target", target, attributes);
+
+      cgraph_node *clone
+        = node->create_version_clone_with_body(vNULL, NULL, NULL, NULL, NULL,
+                                               suffix, attributes, false);
+      free(suffix);
+      if (!clone) {
+        free(target);
+        continue;
+      }
+
+      // Nothing calls the clone; keep it alive until the kzaw pass sees it
+      clone->force_output = true;
+      created++;
+
+      if (dump_file) {
+        fprintf(dump_file, "Explore clone %s for target %s\n",
+                clone->dump_name(), target);
+      }
+      free(target);
+    }
+
+    if (created)
+      DECL_ATTRIBUTES(node->decl)
+        = tree_cons(explore_id,
+                    build_tree_list(NULL_TREE,
+                                    build_int_cst(integer_type_node, created + 1)),
+                    DECL_ATTRIBUTES(node->decl));
+  }
+
+  return 0;
+}
+
+// IPA pass behind -fkzaw-auto-clone.  Runs right before pass_target_clone
+// and gives functions with vectorizable innermost loops a target_clones
+// attribute for the configured targets, so pass_target_clone builds the
+// clones and their resolver as if the source had asked for them.  The kzaw
+// pass later compares the clones like any other group.
+const pass_data pass_data_ipa_kzaw_auto_clone =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-auto-clone", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_auto_clone : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_auto_clone (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_auto_clone, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return flag_kzaw_auto_clone != NULL && targetm.has_ifunc_p();
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// A function picked for automatic cloning
+struct auto_clone_candidate
+{
+  cgraph_node *node;
+  unsigned weight;    // Statements in vectorizable innermost loops
+  unsigned size;      // Estimated size of one copy of the body
+};
+
+// Return the number of statements in LOOP if it looks like something the
+// vectorizer handles: a single exit, memory accesses, and no calls other
+// than builtins and internal functions.  Otherwise return 0.
+static unsigned
+vectorizable_loop_weight(class loop *loop)
+{
+  if (!single_exit(loop))
+    return 0;
+
+  basic_block *bbs = get_loop_body(loop);
+  unsigned stmts = 0, memrefs = 0;
+  bool ok = true;
+
+  for (unsigned i = 0; ok && i < loop->num_nodes; i++) {
+    for (gimple_stmt_iterator gsi = gsi_start_bb(bbs[i]); !gsi_end_p(gsi); gsi_next(&gsi)) {
+      gimple *stmt = gsi_stmt(gsi);
+      if (is_gimple_debug(stmt))
+        continue;
+      if (is_gimple_call(stmt)
+          && !gimple_call_internal_p(stmt)
+          && !gimple_call_builtin_p(stmt, BUILT_IN_NORMAL)) {
+        ok = false;
+        break;
+      }
+      if (is_gimple_assign(stmt) && gimple_vuse(stmt))
+        memrefs++;
+      stmts++;
+    }
+  }
+
+  free(bbs);
+  return ok && memrefs ? stmts : 0;
+}
+
+// Fill CAND for NODE and return true if it is worth cloning automatically
+static bool
+auto_clone_candidate_p(cgraph_node *node, auto_clone_candidate *cand)
+{
+  tree decl = node->decl;
+
+  if (!node->definition || node->alias || node->thunk || node->inlined_to)
+    return false;
+
+  // Leave alone anything already multiversioned or pinned to a target
+  if (DECL_FUNCTION_VERSIONED(decl)
+      || lookup_attribute("target_clones", DECL_ATTRIBUTES(decl))
+      || lookup_attribute("target", DECL_ATTRIBUTES(decl))
+      || lookup_attribute("target_version", DECL_ATTRIBUTES(decl))
+      || lookup_attribute("always_inline", DECL_ATTRIBUTES(decl)))
+    return false;
+
+  // pass_target_clone has to copy the body, and the resolver takes over the
+  // symbol, which main cannot have
+  if (!tree_versionable_function_p(decl)
+      || lookup_attribute("noclone", DECL_ATTRIBUTES(decl))
+      || (DECL_NAME(decl) && MAIN_NAME_P(DECL_NAME(decl))))
+    return false;
+
+  function *fun = DECL_STRUCT_FUNCTION(decl);
+  if (node->frequency == NODE_FREQUENCY_UNLIKELY_EXECUTED
+      || !opt_for_fn(decl, optimize) || opt_for_fn(decl, optimize_size))
+    return false;
+
+  push_cfun(fun);
+  bool init_loops = !loops_for_fn(fun);
+  if (init_loops)
+    loop_optimizer_init(LOOPS_NORMAL);
+
+  cand->node = node;
+  cand->weight = 0;
+  for (auto loop : loops_list(fun, LI_ONLY_INNERMOST))
+    cand->weight += vectorizable_loop_weight(loop);
+
+  if (init_loops)
+    loop_optimizer_finalize();
+
+  cand->size = 0;
+  if (cand->weight) {
+    basic_block bb;
+    FOR_EACH_BB_FN(bb, fun) {
+      for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi))
+        cand->size += estimate_num_insns(gsi_stmt(gsi), &eni_size_weights);
+    }
+  }
+  pop_cfun();
+
+  return cand->weight != 0;
+}
+
+// Order candidates by loop weight, heaviest first
+static int
+compare_auto_clone_candidates(const void *a, const void *b)
+{
+  const auto_clone_candidate *ca = (const auto_clone_candidate *) a;
+  const auto_clone_candidate *cb = (const auto_clone_candidate *) b;
+  if (ca->weight != cb->weight)
+    return ca->weight > cb->weight ? -1 : 1;
+  return ca->node->get_uid() - cb->node->get_uid();
+}
+
+unsigned int
+pass_ipa_kzaw_auto_clone::execute(function *)
+{
+  cgraph_node *node;
+  auto_vec<auto_clone_candidate> candidates;
+  auto_clone_candidate cand;
+
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+    if (auto_clone_candidate_p(node, &cand))
+      candidates.safe_push(cand);
+  }
+  if (candidates.is_empty())
+    return 0;
+
+  // Build the argument list shared by every attribute: "default" and then
+  // each configured target, in the form the target_clones attribute takes
+  tree args = NULL_TREE;
+  unsigned targets = 0;
+  for (const char *p = flag_kzaw_auto_clone; *p; ) {
+    const char *end = strchr(p, ',');
+    size_t len = end ? (size_t) (end - p) : strlen(p);
+    if (len) {
+      args = tree_cons(NULL_TREE, build_string(len, p), args);
+      targets++;
+    }
+    p = end ? end + 1 : p + len;
+  }
+  if (!targets)
+    return 0;
+  args = tree_cons(NULL_TREE, build_string(strlen("default"), "default"),
+                   nreverse(args));
+
+  // Spend the size budget on the heaviest loops first.  SPENT never
+  // exceeds BUDGET, so what is left cannot wrap, and the cost is taken in
+  // HOST_WIDE_INT so that a large body times many targets cannot either.
+  candidates.qsort(compare_auto_clone_candidates);
+  unsigned budget = param_kzaw_auto_clone_budget;
+  unsigned spent = 0;
+
+  for (unsigned i = 0; i < candidates.length(); i++) {
+    auto_clone_candidate &c = candidates[i];
+    unsigned HOST_WIDE_INT cost = (unsigned HOST_WIDE_INT) c.size * targets;
+    tree decl = c.node->decl;
+
+    if (cost > budget - spent) {
+      if (dump_file) {
+        fprintf(dump_file, "Skipping %s: " HOST_WIDE_INT_PRINT_UNSIGNED
+                " insns over budget (%u of %u spent)\n",
+                c.node->dump_name(), cost, spent, budget);
+      }
+      continue;
+    }
+    spent += cost;
+
+    DECL_ATTRIBUTES(decl)
+      = tree_cons(get_identifier("target_clones"), args,
+                  tree_cons(get_identifier(KZAW_AUTO_ATTR), NULL_TREE,
+                            DECL_ATTRIBUTES(decl)));
+
+    if (dump_file) {
+      fprintf(dump_file, "Auto-cloning %s: loop weight %u, %u insns per clone\n",
+              c.node->dump_name(), c.weight, c.size);
+    }
+  }
+
+  return 0;
+}
+
+// IPA pass behind -fkzaw-prune-implied.  Runs right before pass_target_clone,
+// after pass_ipa_kzaw_auto_clone, and removes every target_clones entry whose
+// target adds nothing to the options the function is compiled with, such as
+// popcnt under -march=x86-64-v3 or rng under -march=armv8.5-a.  The resolver
+// could never prefer such a variant over the default, so it is not created
+// and its body is never optimized.
+const pass_data pass_data_ipa_kzaw_implied =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-implied", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_implied : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_implied (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_implied, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return flag_kzaw_prune_implied && targetm.has_ifunc_p();
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// Return a scratch decl with the optimization options of DECL and target
+// options TARGET, built the way pass_target_clone builds them on a clone,
+// or NULL_TREE if TARGET is invalid.  VERSION parses TARGET as a clone
+// target, which some targets spell as for target_version; otherwise it is a
+// target attribute string.  The attribute is kept on the decl for the
+// version priority hook to read.
+static tree
+build_target_probe(tree decl, const char *target, bool version)
+{
+  tree probe = build_fn_decl("kzaw_probe", TREE_TYPE(decl));
+  DECL_FUNCTION_SPECIFIC_OPTIMIZATION(probe)
+    = DECL_FUNCTION_SPECIFIC_OPTIMIZATION(decl);
+  tree args = build_tree_list(NULL_TREE, build_string(strlen(target), target));
+
+  bool target_version = version && !TARGET_HAS_FMV_TARGET_ATTRIBUTE;
+  bool valid;
+  if (target_version)
+    valid = targetm.target_option.valid_version_attribute_p(probe, NULL_TREE,
+                                                            args, 0);
+  else
+    valid = targetm.target_option.valid_attribute_p(probe, NULL_TREE, args, 0);
+  if (!valid)
+    return NULL_TREE;
+
+  DECL_ATTRIBUTES(probe)
+    = tree_cons(get_identifier(target_version ? "target_version" : "target"),
+                args, NULL_TREE);
+  return probe;
+}
+
+// Return true if clone target TARGET of DECL selects nothing that DECL's own
+// options lack.  The subset test is the one pass_target_clone uses to
+// redirect calls to a specific clone.
+static bool
+target_implied_p(tree decl, const char *target)
+{
+  tree probe = build_target_probe(decl, target, true);
+
+  // Leave invalid targets for pass_target_clone to diagnose
+  return probe && targetm.target_option.can_inline_p(decl, probe);
+}
+
+// Remove from the target_clones attribute of NODE every target for which
+// DROP returns true, and list the removed targets under attribute RECORD so
+// the kzaw pass can report them.  A group left with only its default is not
+// multiversioned at all.  Returns the number of targets removed.
+static unsigned
+drop_clone_targets(cgraph_node *node, bool (*drop)(tree, const char *),
+                   const char *record, const char *why)
+{
+  tree decl = node->decl;
+  tree attr = lookup_attribute("target_clones", DECL_ATTRIBUTES(decl));
+  if (!attr)
+    return 0;
+
+  // Split every string into its targets; the default is always kept
+  tree kept = NULL_TREE, dropped = NULL_TREE;
+  unsigned kept_targets = 0, dropped_targets = 0;
+  for (tree arg = TREE_VALUE(attr); arg; arg = TREE_CHAIN(arg)) {
+    for (const char *p = TREE_STRING_POINTER(TREE_VALUE(arg)); *p; ) {
+      const char *end = strchr(p, ',');
+      size_t len = end ? (size_t) (end - p) : strlen(p);
+      char *target = xstrndup(p, len);
+      p = end ? end + 1 : p + len;
+      if (!len) {
+        free(target);
+        continue;
+      }
+
+      tree str = build_string(len, target);
+      if (strcmp(target, "default") != 0 && drop(decl, target)) {
+        dropped = tree_cons(NULL_TREE, str, dropped);
+        dropped_targets++;
+        if (dump_file) {
+          fprintf(dump_file, "Dropping %s from %s: %s\n",
+                  target, node->dump_name(), why);
+        }
+      } else {
+        kept = tree_cons(NULL_TREE, str, kept);
+        if (strcmp(target, "default") != 0)
+          kept_targets++;
+      }
+      free(target);
+    }
+  }
+  if (!dropped)
+    return 0;
+
+  tree attrs = remove_attribute("target_clones", copy_list(DECL_ATTRIBUTES(decl)));
+  if (kept_targets)
+    attrs = tree_cons(get_identifier("target_clones"), nreverse(kept), attrs);
+  DECL_ATTRIBUTES(decl)
+    = tree_cons(get_identifier(record), nreverse(dropped), attrs);
+  return dropped_targets;
+}
+
+unsigned int
+pass_ipa_kzaw_implied::execute(function *)
+{
+  cgraph_node *node;
+
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+    if (!node->definition || node->alias || node->thunk)
+      continue;
+    drop_clone_targets(node, target_implied_p, KZAW_IMPLIED_ATTR,
+                       "implied by its target options");
+  }
+
+  return 0;
+}
+
+// IPA pass behind -fkzaw-decision-manifest.  Runs after
+// pass_ipa_kzaw_implied, ahead of the passes that weigh the remaining
+// targets, and fingerprints every target_clones function.  Targets that
+// the manifest records as identical to the default under the same
+// fingerprint are not created: an earlier build already compared them and
+// found nothing to gain.  Records of a function of this unit under another
+// fingerprint are forgotten, so its targets are created and compared
+// again.  The kzaw pass adds its new PRUNE decisions to the records, once
+// pass_kzaw_rtl has confirmed them, and writes them back at the end of the
+// unit.
+const pass_data pass_data_ipa_kzaw_manifest =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-manifest", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_manifest : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_manifest (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_manifest, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return flag_kzaw_decision_manifest != NULL;
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// Records of the function being decided, for drop_recorded
+static unsigned manifest_first, manifest_end;
+
+static int
+compare_manifest_entries(const void *a, const void *b)
+{
+  return strcmp(((const manifest_entry *) a)->function,
+                ((const manifest_entry *) b)->function);
+}
+
+// Read the -fkzaw-decision-manifest file into MANIFEST_ENTRIES, sorted by
+// function.  A missing file is an empty manifest, as in a first build.
+static void
+read_decision_manifest()
+{
+  FILE *in = fopen(flag_kzaw_decision_manifest, "r");
+  if (!in) {
+    if (errno != ENOENT)
+      warning(0, "cannot read decision manifest %qs: %m",
+              flag_kzaw_decision_manifest);
+    return;
+  }
+
+  char line[1024], fingerprint[32], target[256];
+  for (unsigned lineno = 1; fgets(line, sizeof(line), in); lineno++) {
+    char *p = line + strspn(line, " \t");
+    p[strcspn(p, "\r\n")] = '\0';
+    if (!*p || *p == '#')
+      continue;
+
+    int used;
+    if (sscanf(p, "%31s %255s %n", fingerprint, target, &used) != 2 || !p[used]) {
+      warning(0, "decision manifest %qs, line %u: not a decision record",
+              flag_kzaw_decision_manifest, lineno);
+      continue;
+    }
+    manifest_entry e;
+    e.fingerprint = xstrdup(fingerprint);
+    e.target = xstrdup(target);
+    e.function = xstrdup(p + used);
+    manifest_entries.safe_push(e);
+  }
+  fclose(in);
+  manifest_entries.qsort(compare_manifest_entries);
+}
+
+// Key of DECL in the manifest: the file it is defined in and its assembler
+// name, so static functions of different sources stay apart.  The caller
+// frees it.
+static char *
+manifest_key(tree decl)
+{
+  const char *file = DECL_SOURCE_FILE(decl);
+  return concat(file ? file : "", ":",
+                IDENTIFIER_POINTER(DECL_ASSEMBLER_NAME(decl)), NULL);
+}
+
+// Add to H what the fingerprint takes from operand OP: its code, the kind,
+// size and signedness of its type, the value of a constant and the name of
+// a global, then the same for its own operands.  Local declarations and SSA
+// names only count by code, as their numbering depends on the rest of the
+// unit.
+static void
+fingerprint_operand(tree op, inchash::hash &h)
+{
+  if (!op) {
+    h.add_int(ERROR_MARK);
+    return;
+  }
+
+  h.add_int(TREE_CODE(op));
+  tree type = TREE_TYPE(op);
+  if (type && TYPE_P(type)) {
+    h.add_int(TREE_CODE(type));
+    h.add_flag(TYPE_UNSIGNED(type));
+    if (TYPE_SIZE(type) && tree_fits_uhwi_p(TYPE_SIZE(type)))
+      h.add_hwi(tree_to_uhwi(TYPE_SIZE(type)));
+  }
+
+  if (CONSTANT_CLASS_P(op))
+    inchash::add_expr(op, h);
+  else if (DECL_P(op)) {
+    if ((TREE_CODE(op) == FUNCTION_DECL || (VAR_P(op) && is_global_var(op)))
+        && DECL_NAME(op))
+      h.add(IDENTIFIER_POINTER(DECL_NAME(op)), IDENTIFIER_LENGTH(DECL_NAME(op)));
+  } else if (TREE_CODE(op) == TREE_LIST)
+    fingerprint_operand(TREE_VALUE(op), h);
+  else if (TREE_CODE(op) == CONSTRUCTOR) {
+    unsigned i;
+    tree value;
+    h.add_int(CONSTRUCTOR_NELTS(op));
+    FOR_EACH_CONSTRUCTOR_VALUE(CONSTRUCTOR_ELTS(op), i, value)
+      fingerprint_operand(value, h);
+  } else if (EXPR_P(op))
+    for (int i = 0; i < TREE_OPERAND_LENGTH(op); i++)
+      fingerprint_operand(TREE_OPERAND(op, i), h);
+}
+
+// Add the blocks, edges and statements of FUN to H
+static void
+fingerprint_body(function *fun, inchash::hash &h)
+{
+  basic_block bb;
+
+  h.add_int(n_basic_blocks_for_fn(fun));
+  FOR_EACH_BB_FN(bb, fun) {
+    edge e;
+    edge_iterator ei;
+    FOR_EACH_EDGE(e, ei, bb->succs) {
+      h.add_int(e->dest->index);
+      h.add_int(e->flags & (EDGE_TRUE_VALUE | EDGE_FALSE_VALUE | EDGE_EH
+                            | EDGE_ABNORMAL));
+    }
+    h.add_int(gimple_seq_length(phi_nodes(bb)));
+
+    for (gimple_stmt_iterator gsi = gsi_start_nondebug_bb(bb); !gsi_end_p(gsi);
+         gsi_next_nondebug(&gsi)) {
+      gimple *stmt = gsi_stmt(gsi);
+      h.add_int(gimple_code(stmt));
+      if (is_gimple_assign(stmt) || gimple_code(stmt) == GIMPLE_COND)
+        h.add_int(gimple_expr_code(stmt));
+      else if (gimple_call_internal_p(stmt))
+        h.add_int(gimple_call_internal_fn(stmt));
+      for (unsigned i = 0; i < gimple_num_ops(stmt); i++)
+        fingerprint_operand(gimple_op(stmt, i), h);
+    }
+  }
+}
+
+// Add to H the body of NODE, the bodies in this unit of every function it
+// reaches through calls, which later inlining may bring in, its target and
+// optimization options, and the compiler version
+static void
+fingerprint_function(cgraph_node *node, inchash::hash &h)
+{
+  tree decl = node->decl;
+
+  h.add(version_string, strlen(version_string));
+  tree opts = DECL_FUNCTION_SPECIFIC_TARGET(decl);
+  h.add_int(cl_target_option_hash(TREE_TARGET_OPTION(opts ? opts
+                                                     : target_option_default_node)));
+  opts = DECL_FUNCTION_SPECIFIC_OPTIMIZATION(decl);
+  h.add_int(cl_optimization_hash(TREE_OPTIMIZATION(opts ? opts
+                                                   : optimization_default_node)));
+
+  fingerprint_body(DECL_STRUCT_FUNCTION(decl), h);
+
+  // Callees in the order they are first reached, each once
+  hash_set<cgraph_node *> seen;
+  auto_vec<cgraph_node *> worklist;
+  seen.add(node);
+  worklist.safe_push(node);
+  while (!worklist.is_empty()) {
+    cgraph_node *caller = worklist.pop();
+    for (cgraph_edge *e = caller->callees; e; e = e->next_callee) {
+      cgraph_node *callee = e->callee->ultimate_alias_target();
+      if (seen.add(callee)
+          || !callee->definition || !gimple_has_body_p(callee->decl))
+        continue;
+      fingerprint_body(DECL_STRUCT_FUNCTION(callee->decl), h);
+      worklist.safe_push(callee);
+    }
+  }
+}
+
+// Fingerprint of NODE, in hex in BUF; see fingerprint_function.  Only the
+// same source built the same way by the same compiler gets the same
+// fingerprint.
+static void
+function_fingerprint(cgraph_node *node, char buf[17])
+{
+  inchash::hash lo, hi(KZAW_FINGERPRINT_SEED);
+  fingerprint_function(node, lo);
+  fingerprint_function(node, hi);
+  snprintf(buf, 17, "%08x%08x", (unsigned) hi.end(), (unsigned) lo.end());
+}
+
+// Return true if target TARGET is recorded for the function being decided
+static bool
+drop_recorded(tree, const char *target)
+{
+  for (unsigned i = manifest_first; i < manifest_end; i++)
+    if (manifest_entries[i].fingerprint
+        && strcmp(manifest_entries[i].target, target) == 0)
+      return true;
+  return false;
+}
+
+// Mark a record for removal; it stays sorted by function until then
+static void
+forget_manifest_entry(manifest_entry &e)
+{
+  free(e.fingerprint);
+  e.fingerprint = NULL;
+  manifest_changed = true;
+}
+
+unsigned int
+pass_ipa_kzaw_manifest::execute(function *)
+{
+  read_decision_manifest();
+
+  cgraph_node *node;
+  unsigned dropped = 0, stale = 0;
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+    if (!node->definition || node->alias || node->thunk
+        || !lookup_attribute("target_clones", DECL_ATTRIBUTES(node->decl)))
+      continue;
+
+    char fingerprint[17];
+    function_fingerprint(node, fingerprint);
+    char *key = manifest_key(node->decl);
+
+    // The records of KEY, which the sort keeps together
+    manifest_entry probe;
+    probe.function = key;
+    unsigned lo = 0, hi = manifest_entries.length();
+    while (lo < hi) {
+      unsigned mid = lo + (hi - lo) / 2;
+      if (compare_manifest_entries(&manifest_entries[mid], &probe) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    manifest_first = manifest_end = lo;
+    while (manifest_end < manifest_entries.length()
+           && strcmp(manifest_entries[manifest_end].function, key) == 0)
+      manifest_end++;
+
+    // Decisions taken on another body no longer hold
+    for (unsigned i = manifest_first; i < manifest_end; i++)
+      if (manifest_entries[i].fingerprint
+          && strcmp(manifest_entries[i].fingerprint, fingerprint) != 0) {
+        if (dump_file) {
+          fprintf(dump_file, "Fingerprint of %s changed from %s to %s; "
+                  "checking %s again\n", node->dump_name(),
+                  manifest_entries[i].fingerprint, fingerprint,
+                  manifest_entries[i].target);
+        }
+        forget_manifest_entry(manifest_entries[i]);
+        stale++;
+      }
+
+    dropped += drop_clone_targets(node, drop_recorded, KZAW_MANIFEST_ATTR,
+                                  "pruned in an earlier build");
+
+    // Let the kzaw pass record its own decisions under the same key
+    tree args = tree_cons(NULL_TREE, build_string(strlen(key) + 1, key),
+                          build_tree_list(NULL_TREE,
+                                          build_string(strlen(fingerprint) + 1,
+                                                       fingerprint)));
+    DECL_ATTRIBUTES(node->decl) = tree_cons(get_identifier(KZAW_FINGERPRINT_ATTR),
+                                            args, DECL_ATTRIBUTES(node->decl));
+    free(key);
+  }
+
+  // Drop the forgotten records
+  unsigned kept = 0;
+  for (unsigned i = 0; i < manifest_entries.length(); i++)
+    if (manifest_entries[i].fingerprint)
+      manifest_entries[kept++] = manifest_entries[i];
+    else {
+      free(manifest_entries[i].target);
+      free(manifest_entries[i].function);
+    }
+  manifest_entries.truncate(kept);
+
+  if (dump_file) {
+    fprintf(dump_file, "Decision manifest %s: %u records, %u targets not "
+            "created, %u records out of date\n", flag_kzaw_decision_manifest,
+            manifest_entries.length(), dropped, stale);
+  }
+  return 0;
+}
+
+// RTL pass that closes the unit for the kzaw pass.  Runs late in the RTL
+// pipeline, after pass_machine_reorg, for every function.  Under
+// -fkzaw-decision-manifest it fingerprints the insns of every
+// multiversioned function, so that a variant goes into the manifest only
+// if what is emitted for it matches the default, not just its GIMPLE.
+// Label numbers are left out; register numbers and symbols are not.  Once
+// the last function of the unit gets here, the kzaw pass flushes its open
+// groups and writes the manifest.
+const pass_data pass_data_kzaw_rtl =
+{
+  RTL_PASS, /* type */
+  "kzaw-rtl", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  0, /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_kzaw_rtl : public rtl_opt_pass
+{
+public:
+  pass_kzaw_rtl (gcc::context *ctxt)
+    : rtl_opt_pass (pass_data_kzaw_rtl, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return 1;
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// Functions still to reach pass_kzaw_rtl when they were last counted
+static unsigned functions_left;
+
+// Return true if the current function is the last of the unit to be
+// expanded.  cgraph_node::expand clears the process flag of each function
+// it starts on, so the flags still set are the functions to come.  They are
+// counted down between scans, and scanned again at the end of the count in
+// case expansion added new functions.
+static bool
+last_function_p()
+{
+  if (functions_left > 1) {
+    functions_left--;
+    return false;
+  }
+
+  cgraph_node *node;
+  functions_left = 0;
+  FOR_EACH_FUNCTION(node)
+    if (node->process && node->decl != current_function_decl)
+      functions_left++;
+  return functions_left == 0;
+}
+
+// Add the insns of the current function to H
+static void
+fingerprint_insns(inchash::hash &h)
+{
+  for (rtx_insn *insn = get_insns(); insn; insn = NEXT_INSN(insn)) {
+    if (LABEL_P(insn))
+      h.add_int(CODE_LABEL);
+    else if (NONDEBUG_INSN_P(insn)) {
+      h.add_int(GET_CODE(insn));
+      inchash::add_rtx(PATTERN(insn), h);
+    }
+  }
+}
+
+// Record the RTL fingerprint of NODE, the current function
+static void
+record_rtl_fingerprint(cgraph_node *node)
+{
+  inchash::hash lo, hi(KZAW_FINGERPRINT_SEED);
+  fingerprint_insns(lo);
+  fingerprint_insns(hi);
+
+  if (!rtl_fingerprints)
+    rtl_fingerprints = new rtl_fingerprint_map;
+  rtl_fingerprints->put(node->get_uid(),
+                        ((unsigned HOST_WIDE_INT) hi.end() << 32) | lo.end());
+
+  if (dump_file) {
+    fprintf(dump_file, "RTL fingerprint of %s: %08x%08x\n", node->dump_name(),
+            (unsigned) hi.end(), (unsigned) lo.end());
+  }
+}
+
+unsigned int
+pass_kzaw_rtl::execute(function *)
+{
+  cgraph_node *node = cgraph_node::get(current_function_decl);
+  if (flag_kzaw_decision_manifest && node && first_version(node))
+    record_rtl_fingerprint(node);
+
+  if (last_function_p() && kzaw_pass)
+    kzaw_pass->finish_unit();
+  return 0;
+}
+
+// IPA pass behind -fkzaw-predict-prune.  Runs right before pass_target_clone,
+// after pass_ipa_kzaw_implied, and looks at the default body of every
+// target_clones function for anything whose GIMPLE can come out differently
+// for another target: loops the vectorizer may take, bit-manipulation loops
+// that niter analysis turns into popcount or ctz, builtins and internal
+// functions that are expanded when the target supports them, floating
+// multiply-adds, generic vector operations, byte-swap patterns, adjacent
+// stores, and calls to other multiversioned functions.  A function with none
+// of these would give clones identical to its default, so its targets are
+// dropped before any clone is made.  The kzaw pass compares whatever groups
+// remain as usual.
+const pass_data pass_data_ipa_kzaw_predict =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-predict", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_predict : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_predict (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_predict, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return flag_kzaw_predict_prune && targetm.has_ifunc_p();
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// Return true if LOOP only shuffles bits of scalars, the shape niter
+// analysis recognizes as popcount, clz or ctz when the target has them
+static bool
+bit_idiom_loop_p(class loop *loop)
+{
+  if (!single_exit(loop))
+    return false;
+
+  basic_block *bbs = get_loop_body(loop);
+  bool bit_ops = false, other = false;
+
+  for (unsigned i = 0; !other && i < loop->num_nodes; i++) {
+    for (gimple_stmt_iterator gsi = gsi_start_bb(bbs[i]); !gsi_end_p(gsi); gsi_next(&gsi)) {
+      gimple *stmt = gsi_stmt(gsi);
+      if (is_gimple_call(stmt) || gimple_vuse(stmt)) {
+        other = true;
+        break;
+      }
+      if (is_gimple_assign(stmt)) {
+        switch (gimple_assign_rhs_code(stmt)) {
+        case BIT_AND_EXPR:
+        case RSHIFT_EXPR:
+        case LSHIFT_EXPR:
+          bit_ops = true;
+          break;
+        default:
+          break;
+        }
+      }
+    }
+  }
+
+  free(bbs);
+  return bit_ops && !other;
+}
+
+// Return true if SSA name OP is set by a shift by a whole number of bytes
+static bool
+byte_shift_p(tree op)
+{
+  if (TREE_CODE(op) != SSA_NAME)
+    return false;
+  gimple *def = SSA_NAME_DEF_STMT(op);
+  if (!is_gimple_assign(def))
+    return false;
+
+  tree_code code = gimple_assign_rhs_code(def);
+  if (code != LSHIFT_EXPR && code != RSHIFT_EXPR)
+    return false;
+  tree amount = gimple_assign_rhs2(def);
+  return (TREE_CODE(amount) == INTEGER_CST
+          && tree_fits_uhwi_p(amount) && tree_to_uhwi(amount) % BITS_PER_UNIT == 0);
+}
+
+// Return why STMT of FUN may come out differently for another target, or
+// NULL.  Options are FUN's own, which optimize attributes or LTO may have
+// set apart from the command line.
+static const char *
+target_sensitive_stmt(function *fun, gimple *stmt)
+{
+  if (gcall *call = dyn_cast<gcall *>(stmt)) {
+    if (gimple_call_internal_p(call))
+      return "internal function call";
+
+    tree fndecl = gimple_call_fndecl(call);
+    if (!fndecl)
+      return NULL;
+    if (fndecl_built_in_p(fndecl, BUILT_IN_MD))
+      return "target builtin";
+    if (fndecl_built_in_p(fndecl, BUILT_IN_NORMAL)
+        && associated_internal_fn(fndecl) != IFN_LAST)
+      return "builtin with a target expansion";
+    if (DECL_FUNCTION_VERSIONED(fndecl)
+        || lookup_attribute("target_clones", DECL_ATTRIBUTES(fndecl)))
+      return "call to a multiversioned function";
+    return NULL;
+  }
+
+  if (!is_gimple_assign(stmt))
+    return NULL;
+
+  tree lhs = gimple_assign_lhs(stmt);
+  if (VECTOR_TYPE_P(TREE_TYPE(lhs)))
+    return "generic vector operation";
+
+  switch (gimple_assign_rhs_code(stmt)) {
+  case MULT_EXPR:
+    if (FLOAT_TYPE_P(TREE_TYPE(lhs))
+        && opt_for_fn(fun->decl, flag_fp_contract_mode) != FP_CONTRACT_OFF)
+      return "floating multiply-add";
+    break;
+
+  case BIT_IOR_EXPR:
+  case BIT_XOR_EXPR:
+  case PLUS_EXPR:
+    if (INTEGRAL_TYPE_P(TREE_TYPE(lhs))
+        && (byte_shift_p(gimple_assign_rhs1(stmt))
+            || byte_shift_p(gimple_assign_rhs2(stmt))))
+      return "byte-swap pattern";
+    break;
+
+  default:
+    break;
+  }
+  return NULL;
+}
+
+// Return true if BB stores to memory more than once through the same base
+// with the same type, which the basic-block vectorizer may merge
+static bool
+adjacent_stores_p(basic_block bb)
+{
+  tree last_base = NULL_TREE, last_type = NULL_TREE;
+
+  for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+    gimple *stmt = gsi_stmt(gsi);
+    if (!gimple_assign_single_p(stmt) || !gimple_vdef(stmt)
+        || gimple_has_volatile_ops(stmt))
+      continue;
+
+    tree lhs = gimple_assign_lhs(stmt);
+    tree base = get_base_address(lhs);
+    if (base && TREE_CODE(base) == MEM_REF)
+      base = TREE_OPERAND(base, 0);
+    if (base && last_base && operand_equal_p(base, last_base, 0)
+        && types_compatible_p(TREE_TYPE(lhs), last_type))
+      return true;
+    last_base = base;
+    last_type = TREE_TYPE(lhs);
+  }
+  return false;
+}
+
+// Return why the default body of NODE may give clones that differ from it,
+// or NULL if every clone would come out the same
+static const char *
+clone_difference_reason(cgraph_node *node)
+{
+  function *fun = DECL_STRUCT_FUNCTION(node->decl);
+  const char *reason = NULL;
+
+  push_cfun(fun);
+  bool init_loops = !loops_for_fn(fun);
+  if (init_loops)
+    loop_optimizer_init(LOOPS_NORMAL);
+
+  for (auto loop : loops_list(fun, LI_ONLY_INNERMOST)) {
+    if (vectorizable_loop_weight(loop))
+      reason = "vectorizable loop";
+    else if (bit_idiom_loop_p(loop))
+      reason = "bit-manipulation loop";
+    if (reason)
+      break;
+  }
+
+  basic_block bb;
+  FOR_EACH_BB_FN(bb, fun) {
+    if (reason)
+      break;
+    for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+      reason = target_sensitive_stmt(fun, gsi_stmt(gsi));
+      if (reason)
+        break;
+    }
+    if (!reason && adjacent_stores_p(bb))
+      reason = "adjacent stores";
+  }
+
+  if (init_loops)
+    loop_optimizer_finalize();
+  pop_cfun();
+  return reason;
+}
+
+// Drop every target: the predictor works per function, not per target
+static bool
+drop_every_target(tree, const char *)
+{
+  return true;
+}
+
+unsigned int
+pass_ipa_kzaw_predict::execute(function *)
+{
+  cgraph_node *node;
+
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+    if (!node->definition || node->alias || node->thunk
+        || !lookup_attribute("target_clones", DECL_ATTRIBUTES(node->decl)))
+      continue;
+
+    const char *reason = clone_difference_reason(node);
+    if (reason) {
+      if (dump_file) {
+        fprintf(dump_file, "Keeping clones of %s: %s\n", node->dump_name(), reason);
+      }
+      continue;
+    }
+    drop_clone_targets(node, drop_every_target, KZAW_PREDICTED_ATTR,
+                       "nothing in the body depends on the target");
+  }
+
+  return 0;
+}
+
+// IPA pass behind -fkzaw-fleet-manifest.  Runs right before
+// pass_target_clone, after pass_ipa_kzaw_predict, and works out for every
+// target_clones function which variant its resolver would select on each
+// host of the manifest: the highest-priority variant whose ISA the host
+// has, or the default.  Variants no host selects are not created.  When no
+// host selects the default either, it is marked so the kzaw pass reduces it
+// to a call to a variant every host supports; that happens after the kzaw
+// pass has compared it with its clones, so the similarity check still sees
+// the real body.
+const pass_data pass_data_ipa_kzaw_fleet =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-fleet", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_fleet : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_fleet (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_fleet, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return flag_kzaw_fleet_manifest != NULL && targetm.has_ifunc_p();
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// One variant of the function being decided, for drop_unselected
+struct fleet_variant
+{
+  char *target;       // Target string, as in target_clones
+  tree probe;         // Decl with its target options, or NULL_TREE
+  bool selected;      // Some host's resolver would return it
+  unsigned hosts;     // Number of hosts whose resolver would return it
+  bool everywhere;    // Every host supports it
+};
+
+static vec<fleet_variant> fleet_variants;
+
+// Read the manifest named by -fkzaw-fleet-manifest into HOSTS: one host per
+// line, given as a target attribute string for its ISA, such as
+// arch=x86-64-v3 or +sve2+rng.  Text after # is a comment.  Invalid lines
+// are reported and skipped, as are hosts the default target cannot be
+// inlined into.  Hosts are matched to variants with the inlining subset
+// test, which on x86 also wants the same CPU model and tuning, so a host
+// given by CPU name (arch=skylake) would seem to support no variant at
+// all.  Returns false if the file cannot be read.
+static bool
+read_fleet_manifest(vec<char *> *hosts)
+{
+  FILE *in = fopen(flag_kzaw_fleet_manifest, "r");
+  if (!in) {
+    error("cannot read fleet manifest %qs: %m", flag_kzaw_fleet_manifest);
+    return false;
+  }
+
+  tree scratch = build_fn_decl("kzaw_probe",
+                               build_function_type_list(void_type_node, NULL_TREE));
+  char line[256];
+  for (unsigned lineno = 1; fgets(line, sizeof(line), in); lineno++) {
+    char *p = line + strspn(line, " \t");
+    p[strcspn(p, "#\r\n")] = '\0';
+    size_t len = strlen(p);
+    while (len && ISSPACE(p[len - 1]))
+      p[--len] = '\0';
+    if (!len)
+      continue;
+
+    tree host = build_target_probe(scratch, p, false);
+    if (!host) {
+      warning(0, "fleet manifest %qs, line %u: %qs is not a valid target",
+              flag_kzaw_fleet_manifest, lineno, p);
+      continue;
+    }
+    if (!targetm.target_option.can_inline_p(host, scratch)) {
+      warning(0, "fleet manifest %qs, line %u: host %qs cannot be compared "
+              "with the default target; give its ISA level or features, "
+              "not a CPU name", flag_kzaw_fleet_manifest, lineno, p);
+      continue;
+    }
+    hosts->safe_push(xstrdup(p));
+  }
+  fclose(in);
+  return true;
+}
+
+// Return true if target TARGET of DECL is one no host selects
+static bool
+drop_unselected(tree, const char *target)
+{
+  for (unsigned i = 0; i < fleet_variants.length(); i++)
+    if (strcmp(fleet_variants[i].target, target) == 0)
+      return !fleet_variants[i].selected;
+  return false;
+}
+
+// Decide the variants of NODE for the fleet HOSTS
+static void
+apply_fleet(cgraph_node *node, const vec<char *> &hosts)
+{
+  tree decl = node->decl;
+  tree attr = lookup_attribute("target_clones", DECL_ATTRIBUTES(decl));
+
+  for (tree arg = TREE_VALUE(attr); arg; arg = TREE_CHAIN(arg)) {
+    for (const char *p = TREE_STRING_POINTER(TREE_VALUE(arg)); *p; ) {
+      const char *end = strchr(p, ',');
+      size_t len = end ? (size_t) (end - p) : strlen(p);
+      if (len && strncmp(p, "default", len) != 0) {
+        fleet_variant v;
+        v.target = xstrndup(p, len);
+        v.probe = build_target_probe(decl, v.target, true);
+        // Leave invalid targets for pass_target_clone to diagnose
+        v.selected = !v.probe;
+        v.everywhere = v.probe != NULL_TREE;
+        v.hosts = 0;
+        fleet_variants.safe_push(v);
+      }
+      p = end ? end + 1 : p + len;
+    }
+  }
+
+  // Pick what each host's resolver would return
+  unsigned default_hosts = 0;
+  for (unsigned h = 0; h < hosts.length(); h++) {
+    tree host = build_target_probe(decl, hosts[h], false);
+    int best = -1;
+    for (unsigned i = 0; i < fleet_variants.length(); i++) {
+      fleet_variant &v = fleet_variants[i];
+      if (!v.probe)
+        continue;
+      if (!host || !targetm.target_option.can_inline_p(host, v.probe)) {
+        v.everywhere = false;
+        continue;
+      }
+      if (best < 0
+          || targetm.compare_version_priority(v.probe, fleet_variants[best].probe) > 0)
+        best = i;
+    }
+    if (best < 0)
+      default_hosts++;
+    else {
+      fleet_variants[best].selected = true;
+      fleet_variants[best].hosts++;
+    }
+  }
+
+  drop_clone_targets(node, drop_unselected, KZAW_FLEET_ATTR,
+                     "no host of the fleet selects it");
+
+  // Without hosts for it, the default only needs to forward to a variant
+  // all of them can run
+  int fallback = -1;
+  if (!default_hosts)
+    for (unsigned i = 0; i < fleet_variants.length(); i++)
+      if (fleet_variants[i].selected && fleet_variants[i].everywhere
+          && (fallback < 0
+              || targetm.compare_version_priority(fleet_variants[i].probe,
+                                                  fleet_variants[fallback].probe) > 0))
+        fallback = i;
+  if (fallback >= 0) {
+    const char *target = fleet_variants[fallback].target;
+    DECL_ATTRIBUTES(decl)
+      = tree_cons(get_identifier(KZAW_FLEET_FALLBACK_ATTR),
+                  build_string(strlen(target), target), DECL_ATTRIBUTES(decl));
+    if (dump_file) {
+      fprintf(dump_file, "No host selects the default of %s; it will call %s\n",
+              node->dump_name(), target);
+    }
+  }
+
+  // Keep the host counts for pass_ipa_kzaw_sections
+  tree shares = NULL_TREE;
+  if (default_hosts)
+    shares = tree_cons(build_string(strlen("default"), "default"),
+                       build_int_cst(unsigned_type_node, default_hosts), shares);
+  for (unsigned i = 0; i < fleet_variants.length(); i++)
+    if (fleet_variants[i].hosts) {
+      const char *target = fleet_variants[i].target;
+      shares = tree_cons(build_string(strlen(target), target),
+                         build_int_cst(unsigned_type_node, fleet_variants[i].hosts),
+                         shares);
+    }
+  DECL_ATTRIBUTES(decl) = tree_cons(get_identifier(KZAW_FLEET_HOSTS_ATTR),
+                                    shares, DECL_ATTRIBUTES(decl));
+
+  for (unsigned i = 0; i < fleet_variants.length(); i++)
+    free(fleet_variants[i].target);
+  fleet_variants.truncate(0);
+}
+
+unsigned int
+pass_ipa_kzaw_fleet::execute(function *)
+{
+  auto_vec<char *> hosts;
+  if (!read_fleet_manifest(&hosts))
+    return 0;
+
+  if (dump_file) {
+    fprintf(dump_file, "Fleet manifest %s: %u hosts\n",
+            flag_kzaw_fleet_manifest, hosts.length());
+  }
+
+  if (!hosts.is_empty()) {
+    cgraph_node *node;
+    FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+      if (!node->definition || node->alias || node->thunk
+          || !lookup_attribute("target_clones", DECL_ATTRIBUTES(node->decl)))
+        continue;
+      apply_fleet(node, hosts);
+    }
+  }
+
+  for (unsigned i = 0; i < hosts.length(); i++)
+    free(hosts[i]);
+  fleet_variants.release();
+  return 0;
+}
+
+// IPA pass behind --param=kzaw-clone-size-budget.  Runs right before
+// pass_target_clone, after the passes that drop variants known to be
+// useless, and caps the bytes the remaining variants may add to the unit.
+// Each (function, target) pair is an item whose size is that of one copy of
+// the body and whose benefit is the work in it that the target does better
+// than the function's own options, weighted by block frequency and by how
+// hot the function is.  A 0/1 knapsack over
+// the budget picks the variants to keep; the others are never created.
+// The small IPA passes run per unit even under -flto, so the budget is
+// per translation unit.
+const pass_data pass_data_ipa_kzaw_budget =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-budget", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_budget : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_budget (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_budget, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return param_kzaw_clone_size_budget != 0 && targetm.has_ifunc_p();
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// Most capacity units the knapsack table is built with; larger budgets are
+// counted in coarser units, with sizes rounded up so the budget still holds
+#define KZAW_BUDGET_UNITS 4096
+
+// One variant competing for the budget
+struct budget_item
+{
+  cgraph_node *node;
+  char *target;       // Target string, as in target_clones
+  unsigned bytes;     // Estimated size of the variant
+  uint64_t benefit;   // Estimated value of keeping it
+  bool keep;          // Chosen by the knapsack
+};
+
+// Items of the unit, for drop_over_budget
+static vec<budget_item> budget_items;
+
+// Estimated bytes of one copy of the body of NODE
+static unsigned
+clone_size_bytes(cgraph_node *node)
+{
+  function *fun = DECL_STRUCT_FUNCTION(node->decl);
+  unsigned insns = 0;
+  basic_block bb;
+
+  FOR_EACH_BB_FN(bb, fun) {
+    for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi))
+      insns += estimate_num_insns(gsi_stmt(gsi), &eni_size_weights);
+  }
+  return insns * param_kzaw_bytes_per_insn;
+}
+
+// Make the options of DECL current for the target hooks and optabs, the
+// way set_cfun does for a function with a body
+static void
+switch_target_options(tree decl)
+{
+  targetm.set_current_function(decl);
+  this_fn_optabs = this_target_optabs;
+}
+
+// Bytes in the vector mode the vectorizer prefers for int elements under
+// the current target options, or 0 if it prefers none
+static unsigned
+preferred_vector_bytes()
+{
+  machine_mode mode = targetm.vectorize.preferred_simd_mode(SImode);
+  return VECTOR_MODE_P(mode) ? estimated_poly_value(GET_MODE_SIZE(mode)) : 0;
+}
+
+// Return 1 if the current target options have an instruction for STMT, a
+// statement target_sensitive_stmt picked, 0 if they do not, and -1 if
+// there is no telling (target builtins, calls to multiversioned functions,
+// byte-swap patterns)
+static int
+target_support(gimple *stmt)
+{
+  if (gcall *call = dyn_cast<gcall *>(stmt)) {
+    if (gimple_call_internal_p(call))
+      return (direct_internal_fn_p(gimple_call_internal_fn(call))
+              ? direct_internal_fn_supported_p(call, OPTIMIZE_FOR_SPEED) : -1);
+    tree fndecl = gimple_call_fndecl(call);
+    if (fndecl && fndecl_built_in_p(fndecl, BUILT_IN_NORMAL)
+        && associated_internal_fn(fndecl) != IFN_LAST)
+      return replacement_internal_fn(call) != IFN_LAST;
+    return -1;
+  }
+
+  if (!is_gimple_assign(stmt))
+    return -1;
+  tree type = TREE_TYPE(gimple_assign_lhs(stmt));
+  if (VECTOR_TYPE_P(type))
+    return VECTOR_MODE_P(TYPE_MODE(type));
+  if (gimple_assign_rhs_code(stmt) == MULT_EXPR && FLOAT_TYPE_P(type))
+    return direct_internal_fn_supported_p(IFN_FMA, type, OPTIMIZE_FOR_SPEED);
+  return -1;
+}
+
+// Estimated value of variant TARGET of NODE: how much of the body the
+// target does better than NODE's own options, weighted by how often each
+// block runs per call and by how hot NODE is.  Statements of vectorizable
+// innermost loops count for the wider vectors the target prefers, and
+// other target-sensitive statements for an instruction the target has and
+// the default lacks; those no hook can judge count for every target.  So
+// under -march=x86-64, arch=x86-64-v3 is worth more than popcnt for a
+// vector loop and the same for a popcount.  Uses the IPA profile when
+// there is one.
+static uint64_t
+clone_benefit(cgraph_node *node, const char *target)
+{
+  function *fun = DECL_STRUCT_FUNCTION(node->decl);
+  tree probe = build_target_probe(node->decl, target, true);
+  sreal work = 0;
+
+  push_cfun(fun);
+  bool init_loops = !loops_for_fn(fun);
+  if (init_loops)
+    loop_optimizer_init(LOOPS_NORMAL);
+
+  auto_bitmap vector_loops;
+  for (auto loop : loops_list(fun, LI_ONLY_INNERMOST))
+    if (vectorizable_loop_weight(loop))
+      bitmap_set_bit(vector_loops, loop->num);
+
+  // What the function's own options do, then what the target does.  An
+  // invalid target is left for pass_target_clone to diagnose and counts as
+  // an improvement everywhere.
+  unsigned base_vector = preferred_vector_bytes();
+  auto_vec<signed char> base_support;
+  basic_block bb;
+  FOR_EACH_BB_FN(bb, fun) {
+    for (gimple_stmt_iterator gsi = gsi_start_nondebug_bb(bb); !gsi_end_p(gsi);
+         gsi_next_nondebug(&gsi))
+      if (target_sensitive_stmt(fun, gsi_stmt(gsi)))
+        base_support.safe_push(probe ? target_support(gsi_stmt(gsi)) : -1);
+  }
+
+  sreal vector_gain = 1;
+  if (probe) {
+    switch_target_options(probe);
+    unsigned vector = preferred_vector_bytes();
+    if (vector <= base_vector)
+      vector_gain = 0;
+    else if (base_vector)
+      vector_gain = sreal(vector - base_vector) / base_vector;
+  }
+
+  profile_count entry = ENTRY_BLOCK_PTR_FOR_FN(fun)->count;
+  unsigned next = 0;
+  FOR_EACH_BB_FN(bb, fun) {
+    bool vector_loop = bitmap_bit_p(vector_loops, bb->loop_father->num);
+    sreal gain = 0;
+    for (gimple_stmt_iterator gsi = gsi_start_nondebug_bb(bb); !gsi_end_p(gsi);
+         gsi_next_nondebug(&gsi)) {
+      gimple *stmt = gsi_stmt(gsi);
+      if (vector_loop)
+        gain += vector_gain;
+      if (target_sensitive_stmt(fun, stmt)) {
+        int base = base_support[next++];
+        if (base < 0 || (base == 0 && target_support(stmt) > 0))
+          gain += 1;
+      }
+    }
+    if (gain > 0)
+      work += bb->count.to_sreal_scale(entry) * gain;
+  }
+
+  if (probe)
+    switch_target_options(node->decl);
+  if (init_loops)
+    loop_optimizer_finalize();
+  pop_cfun();
+
+  // Calls per run from the profile, or a guess from the frequency class
+  sreal calls;
+  profile_count count = node->count.ipa();
+  if (count.initialized_p() && count.nonzero_p())
+    calls = count.to_gcov_type();
+  else
+    switch (node->frequency) {
+    case NODE_FREQUENCY_UNLIKELY_EXECUTED: calls = 0; break;
+    case NODE_FREQUENCY_EXECUTED_ONCE: calls = 1; break;
+    case NODE_FREQUENCY_HOT: calls = 64; break;
+    default: calls = 8; break;
+    }
+
+  sreal benefit = work * calls * 16;
+  return benefit.to_int() > 0 ? benefit.to_int() : 0;
+}
+
+// Return true if target TARGET of DECL lost its place in the budget
+static bool
+drop_over_budget(tree decl, const char *target)
+{
+  for (unsigned i = 0; i < budget_items.length(); i++)
+    if (budget_items[i].node->decl == decl
+        && strcmp(budget_items[i].target, target) == 0)
+      return !budget_items[i].keep;
+  return false;
+}
+
+// Set KEEP on the items of the most total benefit whose sizes fit in BUDGET
+// bytes
+static void
+select_within_budget(vec<budget_item> &items, unsigned budget)
+{
+  unsigned unit = CEIL(budget, KZAW_BUDGET_UNITS);
+  unsigned capacity = budget / unit;
+  auto_vec<uint64_t> best;
+  best.safe_grow_cleared(capacity + 1);
+
+  // TAKEN[i] has bit C set if item I is part of the best choice for C
+  // units among the items up to I
+  auto_vec<sbitmap> taken;
+  for (unsigned i = 0; i < items.length(); i++) {
+    sbitmap row = sbitmap_alloc(capacity + 1);
+    bitmap_clear(row);
+    taken.safe_push(row);
+
+    unsigned weight = CEIL(items[i].bytes, unit);
+    if (weight > capacity || !items[i].benefit)
+      continue;
+    for (unsigned c = capacity; c >= weight; c--) {
+      if (best[c - weight] + items[i].benefit > best[c]) {
+        best[c] = best[c - weight] + items[i].benefit;
+        bitmap_set_bit(row, c);
+      }
+      if (c == weight)
+        break;
+    }
+  }
+
+  unsigned c = capacity;
+  for (unsigned i = items.length(); i-- > 0; ) {
+    items[i].keep = bitmap_bit_p(taken[i], c);
+    if (items[i].keep)
+      c -= CEIL(items[i].bytes, unit);
+    sbitmap_free(taken[i]);
+  }
+}
+
+unsigned int
+pass_ipa_kzaw_budget::execute(function *)
+{
+  cgraph_node *node;
+  unsigned total = 0;
+
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+    if (!node->definition || node->alias || node->thunk)
+      continue;
+    tree attr = lookup_attribute("target_clones", DECL_ATTRIBUTES(node->decl));
+    if (!attr)
+      continue;
+
+    unsigned bytes = clone_size_bytes(node);
+    for (tree arg = TREE_VALUE(attr); arg; arg = TREE_CHAIN(arg)) {
+      for (const char *p = TREE_STRING_POINTER(TREE_VALUE(arg)); *p; ) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+        if (len && strncmp(p, "default", len) != 0) {
+          char *target = xstrndup(p, len);
+          budget_item item = { node, target, bytes, clone_benefit(node, target),
+                               true };
+          budget_items.safe_push(item);
+          total += bytes;
+        }
+        p = end ? end + 1 : p + len;
+      }
+    }
+  }
+
+  unsigned budget = param_kzaw_clone_size_budget;
+  if (dump_file) {
+    fprintf(dump_file, "%u variants need an estimated %u bytes, budget %u\n",
+            budget_items.length(), total, budget);
+  }
+
+  if (total > budget) {
+    select_within_budget(budget_items, budget);
+
+    unsigned kept = 0, kept_bytes = 0;
+    uint64_t kept_benefit = 0;
+    for (unsigned i = 0; i < budget_items.length(); i++) {
+      budget_item &item = budget_items[i];
+      if (dump_file) {
+        fprintf(dump_file, "%s %s of %s: %u bytes, benefit %" PRIu64 "\n",
+                item.keep ? "Keeping" : "Dropping", item.target,
+                item.node->dump_name(), item.bytes, item.benefit);
+      }
+      if (item.keep) {
+        kept++;
+        kept_bytes += item.bytes;
+        kept_benefit += item.benefit;
+      }
+    }
+
+    // Each function appears once per target; drop its targets together
+    for (unsigned i = 0; i < budget_items.length(); i++)
+      if (i == 0 || budget_items[i].node != budget_items[i - 1].node)
+        drop_clone_targets(budget_items[i].node, drop_over_budget,
+                           KZAW_BUDGET_ATTR, "over the clone size budget");
+
+    if (dump_file) {
+      fprintf(dump_file, "Kept %u of %u variants: %u bytes, benefit %" PRIu64 "\n",
+              kept, budget_items.length(), kept_bytes, kept_benefit);
+    }
+  }
+
+  for (unsigned i = 0; i < budget_items.length(); i++)
+    free(budget_items[i].target);
+  budget_items.release();
+  return 0;
+}
+
+// IPA pass behind -fkzaw-self-tune and -fkzaw-force-variants.  Runs after
+// pass_target_clone, ahead of pass_ipa_kzaw_direct_calls, and takes over
+// dispatch for the groups concerned: their resolver returns a stub that
+// calls the variant held in a table in section KZAW_TUNE_SECTION.  The
+// runtime in kzaw-tune.c fills the table on first use, or at startup, with
+// a variant forced from the environment, the variant that ran fastest on
+// this host under the function's runner, or else the variant a copy of the
+// original resolver picks.  Resolvers themselves run while relocations are
+// processed, too early to read the environment or call the runtime.
+const pass_data pass_data_ipa_kzaw_self_tune =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-self-tune", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_self_tune : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_self_tune (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_self_tune, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return (flag_kzaw_self_tune || flag_kzaw_force_variants)
+           && targetm.has_ifunc_p();
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// Runner listed for function NAME in -fkzaw-self-tune, as <name>:<runner>
+// entries separated by commas, or NULL_TREE
+static tree
+self_tune_runner(const char *name)
+{
+  size_t len = strlen(name);
+  if (!flag_kzaw_self_tune)
+    return NULL_TREE;
+  for (const char *p = flag_kzaw_self_tune; *p; ) {
+    const char *end = strchr(p, ',');
+    size_t entry = end ? (size_t) (end - p) : strlen(p);
+    if (entry > len + 1 && strncmp(p, name, len) == 0 && p[len] == ':')
+      return get_identifier_with_length(p + len + 1, entry - len - 1);
+    if (!end)
+      break;
+    p = end + 1;
+  }
+  return NULL_TREE;
+}
+
+// Build the dispatch table of the group of default version DEFAULT_NODE,
+// with RUNNER as its calibration runner if any, NATURAL as its copy of the
+// resolver and VERSIONS as its variants, default first
+static tree
+build_tune_table(cgraph_node *default_node, cgraph_node *runner,
+                 cgraph_node *natural, const vec<cgraph_node *> &versions)
+{
+  tree type = build_array_type_nelts(pointer_sized_int_node, KZAW_TUNE_WORDS);
+  tree table = build_decl(BUILTINS_LOCATION, VAR_DECL,
+                          create_tmp_var_name("kzaw_tune"), type);
+  TREE_STATIC(table) = 1;
+  TREE_ADDRESSABLE(table) = 1;
+  DECL_ARTIFICIAL(table) = 1;
+  DECL_IGNORED_P(table) = 1;
+  DECL_PRESERVE_P(table) = 1;
+  SET_DECL_ALIGN(table, POINTER_SIZE);
+  set_decl_section_name(table, KZAW_TUNE_SECTION);
+
+  // Variants are named by target string, as the cache file and the
+  // forcing variables name them
+  const char *name = IDENTIFIER_POINTER(DECL_NAME(default_node->decl));
+  vec<constructor_elt, va_gc> *elts = NULL;
+  CONSTRUCTOR_APPEND_ELT(elts, size_int(KZAW_TUNE_NAME),
+                         fold_convert(pointer_sized_int_node,
+                                      build_string_literal(strlen(name) + 1, name)));
+  if (runner)
+    CONSTRUCTOR_APPEND_ELT(elts, size_int(KZAW_TUNE_RUNNER),
+                           fold_convert(pointer_sized_int_node,
+                                        build_fold_addr_expr(runner->decl)));
+  CONSTRUCTOR_APPEND_ELT(elts, size_int(KZAW_TUNE_RESOLVER),
+                         fold_convert(pointer_sized_int_node,
+                                      build_fold_addr_expr(natural->decl)));
+  CONSTRUCTOR_APPEND_ELT(elts, size_int(KZAW_TUNE_COUNT),
+                         build_int_cst(pointer_sized_int_node, versions.length()));
+  for (unsigned i = 0; i < versions.length(); i++) {
+    const char *target = version_target(versions[i]->decl);
+    CONSTRUCTOR_APPEND_ELT(elts, size_int(KZAW_TUNE_TARGET(i)),
+                           fold_convert(pointer_sized_int_node,
+                                        build_string_literal(strlen(target) + 1, target)));
+    CONSTRUCTOR_APPEND_ELT(elts, size_int(KZAW_TUNE_ADDRESS(i)),
+                           fold_convert(pointer_sized_int_node,
+                                        build_fold_addr_expr(versions[i]->decl)));
+  }
+  DECL_INITIAL(table) = build_constructor(type, elts);
+
+  varpool_node::finalize_decl(table);
+  return table;
+}
+
+// Make a copy of DEFAULT_NODE whose body only forwards its arguments to the
+// variant that TABLE holds as current.  The table slot is loaded inline,
+// so once a variant has been chosen a call costs one load and the indirect
+// call; __kzaw_tune_get only runs while the slot is still empty.
+static cgraph_node *
+build_tune_stub(cgraph_node *default_node, tree table)
+{
+  static tree tune_get_fn;
+  if (!tune_get_fn) {
+    tree fntype = build_function_type_list(ptr_type_node, ptr_type_node,
+                                           NULL_TREE);
+    tune_get_fn = build_fn_decl("__kzaw_tune_get", fntype);
+    TREE_NOTHROW(tune_get_fn) = 1;
+  }
+
+  cgraph_node *stub = default_node->create_version_clone_with_body(vNULL, NULL,
+                                                                  NULL, NULL, NULL,
+                                                                  "kzaw_tuned");
+  DECL_FUNCTION_VERSIONED(stub->decl) = 0;
+
+  function *fun = DECL_STRUCT_FUNCTION(stub->decl);
+  push_cfun(fun);
+
+  // The slot, read with the same acquire load as __kzaw_tune_get
+  built_in_function fcode
+    = (built_in_function) ((int) BUILT_IN_ATOMIC_LOAD_1
+                           + exact_log2(tree_to_uhwi(TYPE_SIZE_UNIT(pointer_sized_int_node))));
+  tree load_fn = builtin_decl_explicit(fcode);
+  tree slot = build4(ARRAY_REF, pointer_sized_int_node, table,
+                     size_int(KZAW_TUNE_CURRENT), NULL_TREE, NULL_TREE);
+  gcall *load = gimple_build_call(load_fn, 2, build_fold_addr_expr(slot),
+                                  build_int_cst(integer_type_node, MEMMODEL_ACQUIRE));
+  tree word = TREE_TYPE(TREE_TYPE(load_fn));
+  tree current = make_ssa_name(word);
+  gimple_call_set_lhs(load, current);
+
+  tree fntype = TREE_TYPE(stub->decl);
+  tree chosen = make_ssa_name(word);
+  tree fnptr = make_ssa_name(build_pointer_type(fntype));
+  gimple_seq seq = NULL;
+  gimple_seq_add_stmt(&seq, gimple_build_assign(fnptr, NOP_EXPR, chosen));
+  forward_function_body(fun, seq, fnptr);
+
+  // ENTRY: current = load; if (current != 0) goto JOIN; else goto SLOW
+  basic_block entry = single_succ(ENTRY_BLOCK_PTR_FOR_FN(fun));
+  gimple_stmt_iterator gsi = gsi_start_bb(entry);
+  gsi_insert_before(&gsi, load, GSI_NEW_STMT);
+  edge fast = split_block(entry, load);
+  basic_block join = fast->dest;
+  gsi = gsi_last_bb(entry);
+  gsi_insert_after(&gsi, gimple_build_cond(NE_EXPR, current, build_zero_cst(word),
+                                           NULL_TREE, NULL_TREE), GSI_NEW_STMT);
+  fast->flags = EDGE_TRUE_VALUE;
+  fast->probability = profile_probability::very_likely();
+
+  // SLOW: got = __kzaw_tune_get (&table), which fills the slot
+  basic_block slow = create_empty_bb(entry);
+  if (current_loops)
+    add_bb_to_loop(slow, entry->loop_father);
+  edge to_slow = make_edge(entry, slow, EDGE_FALSE_VALUE);
+  to_slow->probability = fast->probability.invert();
+  slow->count = entry->count.apply_probability(to_slow->probability);
+  edge from_slow = make_single_succ_edge(slow, join, EDGE_FALLTHRU);
+
+  gcall *get = gimple_build_call(tune_get_fn, 1,
+                                 build_fold_addr_expr_with_type(table, ptr_type_node));
+  gimple_call_set_lhs(get, make_ssa_name(ptr_type_node));
+  tree got = make_ssa_name(word);
+  gsi = gsi_start_bb(slow);
+  gsi_insert_after(&gsi, get, GSI_NEW_STMT);
+  gsi_insert_after(&gsi, gimple_build_assign(got, NOP_EXPR, gimple_call_lhs(get)),
+                   GSI_NEW_STMT);
+
+  gphi *phi = create_phi_node(chosen, join);
+  add_phi_arg(phi, current, fast, UNKNOWN_LOCATION);
+  add_phi_arg(phi, got, from_slow, UNKNOWN_LOCATION);
+
+  mark_virtual_operands_for_renaming(fun);
+  update_ssa(TODO_update_ssa_only_virtuals);
+
+  stub->remove_callees();
+  stub->remove_all_references();
+  cgraph_edge::rebuild_edges();
+  pop_cfun();
+  return stub;
+}
+
+// Make RESOLVER return STUB for every CPU
+static void
+redirect_resolver(cgraph_node *resolver, cgraph_node *stub)
+{
+  function *fun = DECL_STRUCT_FUNCTION(resolver->decl);
+  tree addr = build_fold_addr_expr_with_type(stub->decl, ptr_type_node);
+  basic_block bb;
+
+  push_cfun(fun);
+  FOR_EACH_BB_FN(bb, fun) {
+    gimple_stmt_iterator gsi = gsi_last_bb(bb);
+    if (gsi_end_p(gsi))
+      continue;
+    greturn *ret = dyn_cast<greturn *>(gsi_stmt(gsi));
+    if (ret && gimple_return_retval(ret)) {
+      gimple_return_set_retval(ret, addr);
+      update_stmt(ret);
+    }
+  }
+  resolver->remove_all_references();
+  cgraph_edge::rebuild_references();
+  pop_cfun();
+}
+
+// Give up on dispatching the group of DECL through kzaw-tune.c because of
+// REASON.  Only functions named in -fkzaw-self-tune (REQUESTED) get a
+// warning; -fkzaw-force-variants skips the rest quietly.
+static bool
+skip_tune_group(tree decl, bool requested, const char *reason)
+{
+  if (requested)
+    warning_at(DECL_SOURCE_LOCATION(decl), 0, "%qD cannot be self-tuned: %s",
+               decl, reason);
+  if (dump_file) {
+    fprintf(dump_file, "Not dispatching %s at run time: %s\n",
+            IDENTIFIER_POINTER(DECL_NAME(decl)), reason);
+  }
+  return false;
+}
+
+// Hand dispatch of the group of DEFAULT_NODE to the runtime in kzaw-tune.c,
+// calibrating with the function named RUNNER_NAME if it is set.  Returns
+// false when the group cannot be handed over.
+static bool
+self_tune_group(cgraph_node *default_node, tree runner_name)
+{
+  tree decl = default_node->decl;
+  tree fntype = TREE_TYPE(decl);
+  bool requested = runner_name != NULL_TREE;
+
+  tree rettype = TREE_TYPE(fntype);
+  if ((!VOID_TYPE_P(rettype) && !is_gimple_reg_type(rettype)) || stdarg_p(fntype))
+    return skip_tune_group(decl, requested, "it returns an aggregate or takes "
+                           "variable arguments");
+
+  cgraph_node *runner = NULL;
+  if (requested) {
+    runner = cgraph_node::get_for_asmname(runner_name);
+    if (!runner || !runner->definition)
+      return skip_tune_group(decl, requested, "its runner is not defined in "
+                             "this unit");
+  }
+
+  // The default goes first, so the runtime can fall back to it
+  auto_vec<cgraph_node *> versions;
+  versions.safe_push(default_node);
+  for (cgraph_function_version_info *v = first_version(default_node);
+       v; v = v->next) {
+    if (v->this_node != default_node && v->this_node->definition
+        && !v->this_node->alias && !v->this_node->dispatcher_function) {
+      if (!version_target(v->this_node->decl))
+        return skip_tune_group(decl, requested, "a version has no target string");
+      versions.safe_push(v->this_node);
+    }
+  }
+  cgraph_node *resolver = group_resolver(default_node);
+  if (!resolver)
+    return skip_tune_group(decl, requested, "no resolver was generated for it");
+  if (versions.length() > KZAW_TUNE_MAX_VARIANTS)
+    return skip_tune_group(decl, requested, "it has too many variants");
+
+  // The copy keeps the CPU-feature choice callable once the resolver
+  // itself only returns the stub
+  cgraph_node *natural = resolver->create_version_clone_with_body(vNULL, NULL,
+                                                                  NULL, NULL, NULL,
+                                                                  "kzaw_natural");
+  tree table = build_tune_table(default_node, runner, natural, versions);
+  cgraph_node *stub = build_tune_stub(default_node, table);
+  redirect_resolver(resolver, stub);
+
+  DECL_ATTRIBUTES(decl) = tree_cons(get_identifier(KZAW_TUNED_ATTR), NULL_TREE,
+                                    DECL_ATTRIBUTES(decl));
+
+  if (dump_file) {
+    fprintf(dump_file, "Dispatching %s over %u variants through %s",
+            default_node->dump_name(), versions.length(), stub->dump_name());
+    if (runner)
+      fprintf(dump_file, ", tuned with runner %s", runner->dump_name());
+    fprintf(dump_file, "\n");
+  }
+  return true;
+}
+
+unsigned int
+pass_ipa_kzaw_self_tune::execute(function *)
+{
+  cgraph_node *node;
+  auto_vec<std::pair<cgraph_node *, tree> > groups;
+
+  // Collect first, since tuning adds a stub function per group
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+    if (!node->definition || node->alias || node->thunk || node->inlined_to
+        || node->dispatcher_function || !node->function_version()
+        || !is_function_default_version(node->decl))
+      continue;
+    tree runner = self_tune_runner(IDENTIFIER_POINTER(DECL_NAME(node->decl)));
+    if (runner || flag_kzaw_force_variants)
+      groups.safe_push(std::make_pair(node, runner));
+  }
+
+  for (unsigned i = 0; i < groups.length(); i++)
+    self_tune_group(groups[i].first, groups[i].second);
+
+  return 0;
+}
+
+// IPA pass behind -fkzaw-shared-resolver.  Runs after
+// pass_ipa_kzaw_self_tune.  Every resolver tests the CPU features on its
+// own, so a unit with thousands of groups repeats the same tests thousands
+// of times while relocations are processed.  Groups with the same set of
+// targets select the same way, so each such set gets one selector: a copy
+// of one group's resolver that returns the index of its choice and stores
+// it in a static variable.  Each resolver of the set is then reduced to
+// loading that index, calling the selector only if it is still unset, and
+// returning the matching entry of a table of the group's versions.  The
+// ifunc relocation of each group remains; the feature tests behind it run
+// once per set.
+const pass_data pass_data_ipa_kzaw_shared_resolver =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-shared-resolver", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_shared_resolver : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_shared_resolver (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_shared_resolver, ctxt)
+  {}
+
+  // Instrumented resolvers record each choice themselves, so they are left
+  // as they are
+  bool gate (function *) final override {
+    return (flag_kzaw_shared_resolver && !flag_kzaw_instrument_clones
+            && targetm.has_ifunc_p());
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// A group whose resolver can share a selector
+struct shared_group
+{
+  cgraph_node *resolver;
+  vec<cgraph_node *> versions;   // Every defined version, default included
+  char *key;                     // Its sorted target strings, joined
+};
+
+static int
+compare_strings(const void *a, const void *b)
+{
+  return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+// Fill GROUP for the group of default version NODE and return true if its
+// resolver can share a selector
+static bool
+shared_group_p(cgraph_node *node, shared_group *group)
+{
+  if (lookup_attribute(KZAW_TUNED_ATTR, DECL_ATTRIBUTES(node->decl)))
+    return false;
+  group->resolver = group_resolver(node);
+  if (!group->resolver)
+    return false;
+
+  auto_vec<const char *> targets;
+  group->versions = vNULL;
+  for (cgraph_function_version_info *v = first_version(node); v; v = v->next) {
+    cgraph_node *version = v->this_node;
+    if (!version->definition || version->dispatcher_function)
+      continue;
+    const char *target = version_target(version->decl);
+    if (!target) {
+      group->versions.release();
+      return false;
+    }
+    group->versions.safe_push(version);
+    targets.safe_push(target);
+  }
+
+  targets.qsort(compare_strings);
+  size_t len = 0;
+  for (unsigned i = 0; i < targets.length(); i++)
+    len += strlen(targets[i]) + 1;
+  group->key = XNEWVEC(char, len + 1);
+  char *p = group->key;
+  for (unsigned i = 0; i < targets.length(); i++)
+    p = stpcpy(stpcpy(p, targets[i]), "|");
+  *p = '\0';
+  return true;
+}
+
+// Version of GROUP with the same target as VERSION, of another group
+static cgraph_node *
+matching_version(const shared_group &group, cgraph_node *version)
+{
+  const char *target = version_target(version->decl);
+  for (unsigned i = 0; i < group.versions.length(); i++)
+    if (strcmp(version_target(group.versions[i]->decl), target) == 0)
+      return group.versions[i];
+  return NULL;
+}
+
+// walk_gimple_op callback replacing the address of the Nth version in
+// wi->info with the index N + 1
+static tree
+replace_version_address(tree *tp, int *walk_subtrees, void *data)
+{
+  walk_stmt_info *wi = (walk_stmt_info *) data;
+  const vec<cgraph_node *> *versions = (const vec<cgraph_node *> *) wi->info;
+
+  if (TYPE_P(*tp)) {
+    *walk_subtrees = 0;
+  } else if (TREE_CODE(*tp) == ADDR_EXPR
+             && TREE_CODE(TREE_OPERAND(*tp, 0)) == FUNCTION_DECL) {
+    *walk_subtrees = 0;
+    for (unsigned i = 0; i < versions->length(); i++)
+      if ((*versions)[i]->decl == TREE_OPERAND(*tp, 0)) {
+        *tp = build_int_cst(TREE_TYPE(*tp), i + 1);
+        wi->changed = true;
+        break;
+      }
+  }
+  return NULL_TREE;
+}
+
+// Make a copy of the resolver of REP that returns the index of its choice
+// among the versions of REP, plus one, and stores it in LEVEL too
+static cgraph_node *
+build_selector(const shared_group &rep, tree level)
+{
+  cgraph_node *selector = rep.resolver->create_version_clone_with_body(vNULL, NULL,
+                                                                      NULL, NULL, NULL,
+                                                                      "kzaw_select");
+  function *fun = DECL_STRUCT_FUNCTION(selector->decl);
+  basic_block bb;
+
+  push_cfun(fun);
+  FOR_EACH_BB_FN(bb, fun) {
+    for (gphi_iterator gpi = gsi_start_phis(bb); !gsi_end_p(gpi); gsi_next(&gpi)) {
+      gphi *phi = gpi.phi();
+      for (unsigned i = 0; i < gimple_phi_num_args(phi); i++) {
+        tree arg = gimple_phi_arg_def(phi, i);
+        tree fn = TREE_CODE(arg) == ADDR_EXPR ? TREE_OPERAND(arg, 0) : NULL_TREE;
+        for (unsigned v = 0; fn && v < rep.versions.length(); v++)
+          if (rep.versions[v]->decl == fn)
+            SET_PHI_ARG_DEF(phi, i, build_int_cst(TREE_TYPE(arg), v + 1));
+      }
+    }
+
+    for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+      gimple *stmt = gsi_stmt(gsi);
+      walk_stmt_info wi;
+      memset(&wi, 0, sizeof(wi));
+      wi.info = const_cast<vec<cgraph_node *> *>(&rep.versions);
+      walk_gimple_op(stmt, replace_version_address, &wi);
+      if (wi.changed)
+        update_stmt(stmt);
+
+      greturn *ret = dyn_cast<greturn *>(stmt);
+      if (ret && gimple_return_retval(ret))
+        gsi_insert_before(&gsi, gimple_build_assign(level, gimple_return_retval(ret)),
+                          GSI_SAME_STMT);
+    }
+  }
+
+  if (gimple_in_ssa_p(fun)) {
+    mark_virtual_operands_for_renaming(fun);
+    update_ssa(TODO_update_ssa_only_virtuals);
+  }
+  cgraph_edge::rebuild_edges();
+  pop_cfun();
+  return selector;
+}
+
+// Build a static table of the versions of GROUP in the order of the
+// versions of REP, one past the index the selector returns
+static tree
+build_version_table(const shared_group &group, const shared_group &rep)
+{
+  unsigned count = rep.versions.length() + 1;
+  tree type = build_array_type_nelts(ptr_type_node, count);
+  tree table = build_decl(BUILTINS_LOCATION, VAR_DECL,
+                          create_tmp_var_name("kzaw_versions"), type);
+  TREE_STATIC(table) = 1;
+  TREE_READONLY(table) = 1;
+  TREE_ADDRESSABLE(table) = 1;
+  DECL_ARTIFICIAL(table) = 1;
+  DECL_IGNORED_P(table) = 1;
+
+  // Entry 0 is never read; the default fills it
+  vec<constructor_elt, va_gc> *elts = NULL;
+  for (unsigned i = 0; i < count; i++) {
+    cgraph_node *version = matching_version(group, rep.versions[i ? i - 1 : 0]);
+    CONSTRUCTOR_APPEND_ELT(elts, size_int(i),
+                           build_fold_addr_expr_with_type(version->decl,
+                                                          ptr_type_node));
+  }
+  DECL_INITIAL(table) = build_constructor(type, elts);
+
+  varpool_node::finalize_decl(table);
+  return table;
+}
+
+// Replace the body of FUN, the current function, a resolver, with
+//   if (LEVEL == 0) SELECTOR ();
+//   return TABLE[LEVEL];
+static void
+build_thin_resolver(function *fun, tree level, cgraph_node *selector, tree table)
+{
+  basic_block test = split_edge(single_succ_edge(ENTRY_BLOCK_PTR_FOR_FN(fun)));
+  remove_edge(single_succ_edge(test));
+  free_dominance_info(CDI_DOMINATORS);
+  delete_unreachable_blocks();
+  if (current_loops)
+    loops_state_set(LOOPS_NEED_FIXUP);
+
+  basic_block select = create_empty_bb(test);
+  basic_block lookup = create_empty_bb(select);
+  edge unset = make_edge(test, select, EDGE_TRUE_VALUE);
+  edge set = make_edge(test, lookup, EDGE_FALSE_VALUE);
+  unset->probability = profile_probability::very_unlikely();
+  set->probability = unset->probability.invert();
+  make_single_succ_edge(select, lookup, EDGE_FALLTHRU);
+  make_single_succ_edge(lookup, EXIT_BLOCK_PTR_FOR_FN(fun), 0);
+  if (current_loops) {
+    add_bb_to_loop(select, test->loop_father);
+    add_bb_to_loop(lookup, test->loop_father);
+  }
+
+  gimple_stmt_iterator gsi = gsi_start_bb(test);
+  tree current = new_temporary(fun, ptr_type_node);
+  gsi_insert_after(&gsi, gimple_build_assign(current, level), GSI_NEW_STMT);
+  gsi_insert_after(&gsi, gimple_build_cond(EQ_EXPR, current, null_pointer_node,
+                                           NULL_TREE, NULL_TREE), GSI_NEW_STMT);
+
+  gsi = gsi_start_bb(select);
+  gsi_insert_after(&gsi, gimple_build_call(selector->decl, 0), GSI_NEW_STMT);
+
+  gsi = gsi_start_bb(lookup);
+  tree chosen = new_temporary(fun, ptr_type_node);
+  gsi_insert_after(&gsi, gimple_build_assign(chosen, level), GSI_NEW_STMT);
+  tree index = new_temporary(fun, sizetype);
+  gsi_insert_after(&gsi, gimple_build_assign(index, NOP_EXPR, chosen), GSI_NEW_STMT);
+  tree entry = build4(ARRAY_REF, ptr_type_node, table, index, NULL_TREE, NULL_TREE);
+  tree result = new_temporary(fun, ptr_type_node);
+  gsi_insert_after(&gsi, gimple_build_assign(result, entry), GSI_NEW_STMT);
+  gsi_insert_after(&gsi, gimple_build_return(result), GSI_NEW_STMT);
+}
+
+unsigned int
+pass_ipa_kzaw_shared_resolver::execute(function *)
+{
+  cgraph_node *node;
+  auto_vec<shared_group> groups;
+  shared_group group;
+
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+    if (!node->definition || node->alias || node->thunk || node->inlined_to
+        || node->dispatcher_function || !node->function_version()
+        || !is_function_default_version(node->decl))
+      continue;
+    if (shared_group_p(node, &group))
+      groups.safe_push(group);
+  }
+
+  // Groups with the same targets share the selector of the first of them
+  hash_map<nofree_string_hash, unsigned> first_with_key;
+  auto_vec<unsigned> members;
+  members.safe_grow_cleared(groups.length());
+  for (unsigned i = 0; i < groups.length(); i++) {
+    bool existed;
+    unsigned &rep = first_with_key.get_or_insert(groups[i].key, &existed);
+    if (!existed)
+      rep = i;
+    members[rep]++;
+  }
+
+  auto_vec<tree> levels;
+  auto_vec<cgraph_node *> selectors;
+  levels.safe_grow_cleared(groups.length());
+  selectors.safe_grow_cleared(groups.length());
+  unsigned shared = 0, selector_count = 0;
+  for (unsigned i = 0; i < groups.length(); i++) {
+    unsigned rep = *first_with_key.get(groups[i].key);
+
+    // A group alone with its targets keeps its own resolver
+    if (members[rep] < 2)
+      continue;
+
+    tree &level = levels[rep];
+    cgraph_node *&selector = selectors[rep];
+    if (!level) {
+      level = build_decl(BUILTINS_LOCATION, VAR_DECL,
+                         create_tmp_var_name("kzaw_level"), ptr_type_node);
+      TREE_STATIC(level) = 1;
+      DECL_ARTIFICIAL(level) = 1;
+      DECL_IGNORED_P(level) = 1;
+      varpool_node::finalize_decl(level);
+      selector = build_selector(groups[rep], level);
+      selector_count++;
+      if (dump_file) {
+        fprintf(dump_file, "Selector %s for targets %s\n",
+                selector->dump_name(), groups[rep].key);
+      }
+    }
+
+    tree table = build_version_table(groups[i], groups[rep]);
+    cgraph_node *resolver = groups[i].resolver;
+    push_cfun(DECL_STRUCT_FUNCTION(resolver->decl));
+    build_thin_resolver(cfun, level, selector, table);
+    if (gimple_in_ssa_p(cfun)) {
+      mark_virtual_operands_for_renaming(cfun);
+      update_ssa(TODO_update_ssa_only_virtuals);
+    }
+    cgraph_edge::rebuild_edges();
+    pop_cfun();
+    shared++;
+
+    if (dump_file) {
+      fprintf(dump_file, "Resolver %s now uses %s\n",
+              resolver->dump_name(), selector->dump_name());
+    }
+  }
+
+  if (dump_file) {
+    fprintf(dump_file, "%u of %u resolvers share %u selectors\n",
+            shared, groups.length(), selector_count);
+  }
+
+  for (unsigned i = 0; i < groups.length(); i++) {
+    groups[i].versions.release();
+    free(groups[i].key);
+  }
+  return 0;
+}
+
+// IPA pass behind -fkzaw-direct-calls.  Runs after pass_target_clone and
+// pass_ipa_kzaw_shared_resolver, once calls to multiversioned functions go
+// through their dispatchers, and calls the callee's version directly
+// wherever the caller's own target already fixes the resolver's choice.
+// The inliner then sees an ordinary direct call, and the call stops paying
+// for the indirect jump.
+const pass_data pass_data_ipa_kzaw_direct_calls =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-direct-calls", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_direct_calls : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_direct_calls (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_direct_calls, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return flag_kzaw_direct_calls && targetm.has_ifunc_p();
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// Return the version of DISPATCHER that its resolver is certain to pick
+// whenever CALLER runs, or NULL.  That is the highest-priority version of
+// all, and only if its ISA is part of CALLER's: any CPU that runs CALLER
+// then supports it, and the resolver never prefers anything else.
+static cgraph_node *
+direct_call_target(cgraph_node *caller, cgraph_node *dispatcher)
+{
+  cgraph_function_version_info *info = dispatcher->function_version();
+  if (!info || !info->next)
+    return NULL;
+
+  // A group dispatched through kzaw-tune.c may be tuned or forced to any
+  // variant, not only the one the ISA selects
+  for (cgraph_function_version_info *v = first_version(info->next->this_node);
+       v; v = v->next)
+    if (lookup_attribute(KZAW_TUNED_ATTR, DECL_ATTRIBUTES(v->this_node->decl)))
+      return NULL;
+
+  cgraph_node *best = NULL;
+  for (cgraph_function_version_info *v = first_version(info->next->this_node);
+       v; v = v->next) {
+    cgraph_node *version = v->this_node;
+    if (version == dispatcher || !version->definition)
+      continue;
+    if (!best || targetm.compare_version_priority(version->decl, best->decl) > 0)
+      best = version;
+  }
+  if (!best)
+    return NULL;
+
+  // Versions tied with the best leave the choice to the CPU
+  for (cgraph_function_version_info *v = first_version(info->next->this_node);
+       v; v = v->next) {
+    cgraph_node *version = v->this_node;
+    if (version != best && version != dispatcher && version->definition
+        && targetm.compare_version_priority(best->decl, version->decl) <= 0)
+      return NULL;
+  }
+
+  return targetm.target_option.can_inline_p(caller->decl, best->decl) ? best : NULL;
+}
+
+unsigned int
+pass_ipa_kzaw_direct_calls::execute(function *)
+{
+  cgraph_node *node;
+
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+    if (!node->definition || node->alias || node->thunk || node->inlined_to)
+      continue;
+
+    // Updating the call statements touches the caller's EH and SSA
+    // operands, so the caller has to be the current function
+    bool pushed = false;
+    cgraph_edge *next;
+    for (cgraph_edge *e = node->callees; e; e = next) {
+      next = e->next_callee;
+      if (!e->callee->dispatcher_function)
+        continue;
+
+      cgraph_node *target = direct_call_target(node, e->callee);
+      if (!target)
+        continue;
+
+      if (dump_file) {
+        fprintf(dump_file, "Calling %s directly from %s\n",
+                target->dump_name(), node->dump_name());
+      }
+      if (!pushed) {
+        push_cfun(DECL_STRUCT_FUNCTION(node->decl));
+        pushed = true;
+      }
+      e->redirect_callee(target);
+      cgraph_edge::redirect_call_stmt_to_callee(e);
+    }
+
+    if (pushed) {
+      if (gimple_in_ssa_p(cfun)) {
+        mark_virtual_operands_for_renaming(cfun);
+        update_ssa(TODO_update_ssa_only_virtuals);
+      }
+      pop_cfun();
+    }
+  }
+
+  return 0;
+}
+
+// IPA pass behind -fkzaw-dedup-clones.  Runs after pass_ipa_kzaw_direct_calls
+// and looks for versions of different multiversioned functions whose bodies
+// are identical, as with template instantiations, copy-pasted kernels or
+// header functions carrying target_clones.  Versions are bucketed by a hash
+// of their statement signatures and then compared exactly, since signatures
+// leave out which operands a statement uses.  Each duplicate becomes an
+// alias of the first version with that body, so its resolver returns the
+// shared body, or a wrapper around it when the duplicate's address must stay
+// distinct.
+const pass_data pass_data_ipa_kzaw_dedup =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-dedup", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_dedup : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_dedup (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_dedup, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return flag_kzaw_dedup_clones && targetm.has_ifunc_p();
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// Exact comparison of two function bodies.  Blocks are paired in layout
+// order; SSA names, parameters, local variables and labels must correspond
+// one to one; everything else must be the same tree.
+class body_matcher
+{
+public:
+  body_matcher (function *a, function *b) : fa (a), fb (b) {}
+
+  bool equal();
+
+private:
+  function *fa, *fb;                  // The two bodies
+  hash_map<tree, tree> a_to_b, b_to_a; // Local names paired so far
+  auto_vec<basic_block> bb_map;       // Blocks of FB by index in FA
+
+  bool same_type_p(tree a, tree b);
+  bool pair_p(tree a, tree b);
+  bool operands_equal_p(tree a, tree b);
+  bool stmts_equal_p(gimple *a, gimple *b);
+  bool blocks_equal_p(basic_block a, basic_block b);
+};
+
+// Return true if A and B have interchangeable types, including for
+// type-based alias analysis
+bool
+body_matcher::same_type_p(tree a, tree b)
+{
+  if (a == b)
+    return true;
+  if (!a || !b || !types_compatible_p(a, b))
+    return false;
+  return get_alias_set(a) == get_alias_set(b);
+}
+
+// Record that A in the first body corresponds to B in the second, or check
+// that it already does
+bool
+body_matcher::pair_p(tree a, tree b)
+{
+  bool existed;
+  tree &to_b = a_to_b.get_or_insert(a, &existed);
+  if (existed)
+    return to_b == b;
+  to_b = b;
+
+  tree &to_a = b_to_a.get_or_insert(b, &existed);
+  if (existed)
+    return false;
+  to_a = a;
+  return true;
+}
+
+bool
+body_matcher::operands_equal_p(tree a, tree b)
+{
+  if (!a || !b)
+    return a == b;
+  if (TREE_CODE(a) != TREE_CODE(b))
+    return false;
+  if (TYPE_P(a))
+    return same_type_p(a, b);
+  if (CONSTANT_CLASS_P(a))
+    return same_type_p(TREE_TYPE(a), TREE_TYPE(b)) && operand_equal_p(a, b, 0);
+
+  switch (TREE_CODE(a)) {
+  case SSA_NAME:
+    if (SSA_NAME_IS_DEFAULT_DEF(a) != SSA_NAME_IS_DEFAULT_DEF(b)
+        || !same_type_p(TREE_TYPE(a), TREE_TYPE(b)))
+      return false;
+    if (SSA_NAME_IS_DEFAULT_DEF(a)
+        && !operands_equal_p(SSA_NAME_VAR(a), SSA_NAME_VAR(b)))
+      return false;
+    return pair_p(a, b);
+
+  case PARM_DECL:
+  case RESULT_DECL:
+  case LABEL_DECL:
+    return same_type_p(TREE_TYPE(a), TREE_TYPE(b)) && pair_p(a, b);
+
+  case VAR_DECL:
+    if (auto_var_in_fn_p(a, fa->decl) && auto_var_in_fn_p(b, fb->decl))
+      return (same_type_p(TREE_TYPE(a), TREE_TYPE(b))
+              && DECL_ALIGN(a) == DECL_ALIGN(b)
+              && TREE_ADDRESSABLE(a) == TREE_ADDRESSABLE(b)
+              && pair_p(a, b));
+    return a == b;
+
+  case CONSTRUCTOR:
+    if (CONSTRUCTOR_NELTS(a) != CONSTRUCTOR_NELTS(b)
+        || TREE_CLOBBER_P(a) != TREE_CLOBBER_P(b)
+        || !same_type_p(TREE_TYPE(a), TREE_TYPE(b)))
+      return false;
+    for (unsigned i = 0; i < CONSTRUCTOR_NELTS(a); i++)
+      if (!operands_equal_p(CONSTRUCTOR_ELT(a, i)->index, CONSTRUCTOR_ELT(b, i)->index)
+          || !operands_equal_p(CONSTRUCTOR_ELT(a, i)->value, CONSTRUCTOR_ELT(b, i)->value))
+        return false;
+    return true;
+
+  case MEM_REF:
+  case TARGET_MEM_REF:
+    if (MR_DEPENDENCE_CLIQUE(a) != MR_DEPENDENCE_CLIQUE(b)
+        || MR_DEPENDENCE_BASE(a) != MR_DEPENDENCE_BASE(b))
+      return false;
+    break;
+
+  default:
+    break;
+  }
+
+  // Decls other than the ones above (globals, functions, fields) are shared
+  if (DECL_P(a))
+    return a == b;
+  if (!EXPR_P(a))
+    return false;
+
+  if (TREE_THIS_VOLATILE(a) != TREE_THIS_VOLATILE(b)
+      || !same_type_p(TREE_TYPE(a), TREE_TYPE(b))
+      || TREE_OPERAND_LENGTH(a) != TREE_OPERAND_LENGTH(b))
+    return false;
+  for (int i = 0; i < TREE_OPERAND_LENGTH(a); i++)
+    if (!operands_equal_p(TREE_OPERAND(a, i), TREE_OPERAND(b, i)))
+      return false;
+  return true;
+}
+
+bool
+body_matcher::stmts_equal_p(gimple *a, gimple *b)
+{
+  if (gimple_code(a) != gimple_code(b)
+      || gimple_num_ops(a) != gimple_num_ops(b)
+      || gimple_has_volatile_ops(a) != gimple_has_volatile_ops(b))
+    return false;
+
+  switch (gimple_code(a)) {
+  case GIMPLE_ASSIGN:
+    if (gimple_assign_rhs_code(a) != gimple_assign_rhs_code(b)
+        || gimple_assign_nontemporal_move_p(as_a<gassign *>(a))
+           != gimple_assign_nontemporal_move_p(as_a<gassign *>(b)))
+      return false;
+    break;
+
+  case GIMPLE_CALL:
+    {
+      gcall *ca = as_a<gcall *>(a), *cb = as_a<gcall *>(b);
+      if (gimple_call_internal_p(ca) != gimple_call_internal_p(cb)
+          || (gimple_call_internal_p(ca)
+              && gimple_call_internal_fn(ca) != gimple_call_internal_fn(cb))
+          || gimple_call_flags(ca) != gimple_call_flags(cb)
+          || gimple_call_tail_p(ca) != gimple_call_tail_p(cb)
+          || !same_type_p(gimple_call_fntype(ca), gimple_call_fntype(cb))
+          || !operands_equal_p(gimple_call_chain(ca), gimple_call_chain(cb)))
+        return false;
+    }
+    break;
+
+  case GIMPLE_COND:
+    if (gimple_cond_code(a) != gimple_cond_code(b))
+      return false;
+    break;
+
+  case GIMPLE_PREDICT:
+    return (gimple_predict_predictor(a) == gimple_predict_predictor(b)
+            && gimple_predict_outcome(a) == gimple_predict_outcome(b));
+
+  case GIMPLE_SWITCH:
+  case GIMPLE_RETURN:
+  case GIMPLE_LABEL:
+  case GIMPLE_GOTO:
+  case GIMPLE_NOP:
+    break;
+
+  default:
+    // asm, EH and OpenMP statements are never shared
+    return false;
+  }
+
+  for (unsigned i = 0; i < gimple_num_ops(a); i++)
+    if (!operands_equal_p(gimple_op(a, i), gimple_op(b, i)))
+      return false;
+  return true;
+}
+
+// Compare the statements, PHIs and outgoing edges of a pair of blocks
+bool
+body_matcher::blocks_equal_p(basic_block a, basic_block b)
+{
+  gimple_stmt_iterator ga = gsi_start_nondebug_bb(a);
+  gimple_stmt_iterator gb = gsi_start_nondebug_bb(b);
+  for (; !gsi_end_p(ga) && !gsi_end_p(gb);
+       gsi_next_nondebug(&ga), gsi_next_nondebug(&gb))
+    if (!stmts_equal_p(gsi_stmt(ga), gsi_stmt(gb)))
+      return false;
+  if (!gsi_end_p(ga) || !gsi_end_p(gb))
+    return false;
+
+  gphi_iterator pa = gsi_start_phis(a), pb = gsi_start_phis(b);
+  for (; !gsi_end_p(pa) && !gsi_end_p(pb); gsi_next(&pa), gsi_next(&pb)) {
+    gphi *phi_a = pa.phi(), *phi_b = pb.phi();
+    if (!operands_equal_p(gimple_phi_result(phi_a), gimple_phi_result(phi_b)))
+      return false;
+
+    // Arguments are matched through the edge from the corresponding block
+    for (unsigned i = 0; i < gimple_phi_num_args(phi_a); i++) {
+      edge ea = gimple_phi_arg_edge(phi_a, i);
+      edge eb = find_edge(bb_map[ea->src->index], b);
+      if (!eb || !operands_equal_p(gimple_phi_arg_def(phi_a, i),
+                                   gimple_phi_arg_def(phi_b, eb->dest_idx)))
+        return false;
+    }
+  }
+  if (!gsi_end_p(pa) || !gsi_end_p(pb))
+    return false;
+
+  if (EDGE_COUNT(a->succs) != EDGE_COUNT(b->succs))
+    return false;
+  const int kinds = EDGE_TRUE_VALUE | EDGE_FALSE_VALUE | EDGE_ABNORMAL | EDGE_EH;
+  for (unsigned i = 0; i < EDGE_COUNT(a->succs); i++) {
+    edge ea = EDGE_SUCC(a, i), eb = EDGE_SUCC(b, i);
+    if (bb_map[ea->dest->index] != eb->dest
+        || (ea->flags & kinds) != (eb->flags & kinds))
+      return false;
+  }
+  return true;
+}
+
+bool
+body_matcher::equal()
+{
+  if (n_basic_blocks_for_fn(fa) != n_basic_blocks_for_fn(fb)
+      || fa->static_chain_decl || fb->static_chain_decl
+      || fa->eh->region_tree || fb->eh->region_tree
+      || fa->has_nonlocal_label || fb->has_nonlocal_label
+      || fa->calls_setjmp || fb->calls_setjmp)
+    return false;
+
+  // Parameters correspond by position
+  tree pa = DECL_ARGUMENTS(fa->decl), pb = DECL_ARGUMENTS(fb->decl);
+  for (; pa && pb; pa = DECL_CHAIN(pa), pb = DECL_CHAIN(pb))
+    if (!operands_equal_p(pa, pb))
+      return false;
+  if (pa || pb
+      || !operands_equal_p(DECL_RESULT(fa->decl), DECL_RESULT(fb->decl)))
+    return false;
+
+  // Pair the blocks in layout order, then compare them
+  bb_map.safe_grow_cleared(last_basic_block_for_fn(fa));
+  bb_map[ENTRY_BLOCK] = ENTRY_BLOCK_PTR_FOR_FN(fb);
+  bb_map[EXIT_BLOCK] = EXIT_BLOCK_PTR_FOR_FN(fb);
+  basic_block a = ENTRY_BLOCK_PTR_FOR_FN(fa)->next_bb;
+  basic_block b = ENTRY_BLOCK_PTR_FOR_FN(fb)->next_bb;
+  for (; a != EXIT_BLOCK_PTR_FOR_FN(fa); a = a->next_bb, b = b->next_bb)
+    bb_map[a->index] = b;
+
+  if (!blocks_equal_p(ENTRY_BLOCK_PTR_FOR_FN(fa), ENTRY_BLOCK_PTR_FOR_FN(fb)))
+    return false;
+  for (a = ENTRY_BLOCK_PTR_FOR_FN(fa)->next_bb; a != EXIT_BLOCK_PTR_FOR_FN(fa);
+       a = a->next_bb)
+    if (!blocks_equal_p(a, bb_map[a->index]))
+      return false;
+  return true;
+}
+
+// A version that may share its body with versions of other functions
+struct dedup_candidate
+{
+  cgraph_node *node;
+  hashval_t hash;     // Signature hash of the body, for bucketing
+};
+
+// Order candidates by hash, then by UID so the first of each body is stable
+static int
+compare_dedup_candidates(const void *a, const void *b)
+{
+  const dedup_candidate *ca = (const dedup_candidate *) a;
+  const dedup_candidate *cb = (const dedup_candidate *) b;
+  if (ca->hash != cb->hash)
+    return ca->hash < cb->hash ? -1 : 1;
+  return ca->node->get_uid() - cb->node->get_uid();
+}
+
+// Hash of the statement signatures of FUN, in block order
+static hashval_t
+body_hash(function *fun)
+{
+  inchash::hash h;
+  basic_block bb;
+
+  h.add_int(n_basic_blocks_for_fn(fun));
+  FOR_EACH_BB_FN(bb, fun) {
+    h.add_int(EDGE_COUNT(bb->succs));
+    for (gimple_stmt_iterator gsi = gsi_start_nondebug_bb(bb); !gsi_end_p(gsi);
+         gsi_next_nondebug(&gsi)) {
+      stmt_sig sig;
+      encode_statement(gsi_stmt(gsi), &sig);
+      h.add_int(sig.code);
+      h.add_int(sig.subcode);
+      h.add_int(sig.nops);
+      h.add_int(sig.op_codes);
+      h.add_int(sig.op_values);
+      free(sig.exact);
+    }
+  }
+  return h.end();
+}
+
+// Return true if DUP and ORIGINAL may share one body: they are versions of
+// different functions with the same target and optimization options
+static bool
+dedup_compatible_p(cgraph_node *dup, cgraph_node *original)
+{
+  if (first_version(dup) == first_version(original)
+      || DECL_FUNCTION_SPECIFIC_TARGET(dup->decl)
+         != DECL_FUNCTION_SPECIFIC_TARGET(original->decl)
+      || DECL_FUNCTION_SPECIFIC_OPTIMIZATION(dup->decl)
+         != DECL_FUNCTION_SPECIFIC_OPTIMIZATION(original->decl)
+      || !types_compatible_p(TREE_TYPE(dup->decl), TREE_TYPE(original->decl)))
+    return false;
+
+  body_matcher matcher(DECL_STRUCT_FUNCTION(original->decl),
+                       DECL_STRUCT_FUNCTION(dup->decl));
+  return matcher.equal();
+}
+
+// Return true if code could compare the address of version DUP with that of
+// another function, either directly or through the ifunc symbol that its
+// resolver returns it for
+static bool
+version_address_matters_p(cgraph_node *dup)
+{
+  if (TREE_PUBLIC(dup->decl) || dup->externally_visible || dup->force_output)
+    return true;
+
+  ipa_ref *ref;
+  for (unsigned i = 0; dup->iterate_referring(i, ref); i++) {
+    if (ref->use != IPA_REF_ADDR)
+      continue;
+    if (!is_resolver_function(ref->referring->decl))
+      return true;
+
+    ipa_ref *alias;
+    FOR_EACH_ALIAS(ref->referring, alias) {
+      if (alias->referring->address_matters_p())
+        return true;
+    }
+  }
+  return false;
+}
+
+// Make DUP share the body of ORIGINAL: an alias when nothing can tell their
+// addresses apart, otherwise a wrapper that tail-calls ORIGINAL.  This is
+// how ipa-icf merges functions.
+static void
+share_body(cgraph_node *dup, cgraph_node *original)
+{
+  if (version_address_matters_p(dup)) {
+    dup->create_wrapper(original);
+    return;
+  }
+
+  symtab->call_cgraph_removal_hooks(dup);
+  dup->release_body(true);
+  dup->reset();
+  cgraph_node::create_alias(dup->decl, original->decl);
+  dup->resolve_alias(original);
+}
+
+unsigned int
+pass_ipa_kzaw_dedup::execute(function *)
+{
+  cgraph_node *node;
+  auto_vec<dedup_candidate> candidates;
+
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+    if (!node->definition || node->alias || node->thunk || node->inlined_to
+        || node->dispatcher_function || !node->function_version()
+        || !first_version(node)->next)
+      continue;
+    dedup_candidate cand = { node, body_hash(DECL_STRUCT_FUNCTION(node->decl)) };
+    candidates.safe_push(cand);
+  }
+  candidates.qsort(compare_dedup_candidates);
+
+  // Within each run of equal hashes, match every version against the
+  // earlier ones that kept their bodies
+  unsigned shared = 0;
+  for (unsigned start = 0, end; start < candidates.length(); start = end) {
+    for (end = start + 1;
+         end < candidates.length() && candidates[end].hash == candidates[start].hash;
+         end++)
+      ;
+
+    for (unsigned i = start + 1; i < end; i++) {
+      cgraph_node *dup = candidates[i].node;
+      for (unsigned j = start; j < i; j++) {
+        cgraph_node *original = candidates[j].node;
+        if (!original->definition || original->alias || original->thunk
+            || !dedup_compatible_p(dup, original))
+          continue;
+
+        if (dump_file) {
+          fprintf(dump_file, "%s has the same body as %s; sharing it\n",
+                  dup->dump_name(), original->dump_name());
+        }
+        share_body(dup, original);
+        shared++;
+        break;
+      }
+    }
+  }
+
+  if (dump_file) {
+    fprintf(dump_file, "%u of %u versions now share another version's body\n",
+            shared, candidates.length());
+  }
+  return 0;
+}
+
+// IPA pass behind -fkzaw-variant-sections.  Runs last, after
+// pass_ipa_kzaw_dedup, and takes the versions of multiversioned functions
+// out of the middle of .text, where every host's i-cache and iTLB carry the
+// siblings it never runs.  Under -fkzaw-fleet-manifest, the variant most
+// hosts select is hot and variants selected by fewer than
+// --param=kzaw-cold-variant-percent of them are cold; -fkzaw-variant-profile
+// splits them the same way by the calls -fkzaw-instrument-clones counted.
+// Hot versions go to .text.hot and cold ones to .text.unlikely, which the
+// linker gathers apart from the rest of the text, so the variants the
+// common host runs sit together.  Resolvers only run while relocations are
+// processed and go to .text.startup.  Sections are set directly: lowering
+// the node's frequency would also make GCC optimize cold versions for size,
+// and some hosts still run them.
+const pass_data pass_data_ipa_kzaw_sections =
+{
+  SIMPLE_IPA_PASS, /* type */
+  "kzaw-sections", /* name */
+  OPTGROUP_NONE, /* optinfo_flags */
+  TV_NONE, /* tv_id */
+  ( PROP_ssa | PROP_cfg ), /* properties_required */
+  0, /* properties_provided */
+  0, /* properties_destroyed */
+  0, /* todo_flags_start */
+  0, /* todo_flags_finish */
+};
+
+class pass_ipa_kzaw_sections : public simple_ipa_opt_pass
+{
+public:
+  pass_ipa_kzaw_sections (gcc::context *ctxt)
+    : simple_ipa_opt_pass (pass_data_ipa_kzaw_sections, ctxt)
+  {}
+
+  bool gate (function *) final override {
+    return flag_kzaw_variant_sections && targetm_common.have_named_sections;
+  }
+
+  unsigned int execute (function *) final override;
+};
+
+// How often a version is expected to run, ordered so that a body shared by
+// several versions takes the warmest of them
+enum variant_heat
+{
+  VARIANT_COLD,
+  VARIANT_UNKNOWN,
+  VARIANT_HOT
+};
+
+typedef hash_map<tree, unsigned HOST_WIDE_INT> variant_call_map;
+
+// Sum the calls of the counters file named by -fkzaw-variant-profile into
+// CALLS, keyed by the variant's assembler name.  Every line is
+// <pid> <variant> <selected> <calls>, as kzaw-clone-counters.c appends them,
+// so the file may hold any number of runs.  Returns false if the file cannot
+// be read.
+static bool
+read_variant_profile(variant_call_map *calls)
+{
+  FILE *in = fopen(flag_kzaw_variant_profile, "r");
+  if (!in) {
+    error("cannot read variant profile %qs: %m", flag_kzaw_variant_profile);
+    return false;
+  }
+
+  char line[512], name[256];
+  unsigned long selected, count;
+  for (unsigned lineno = 1; fgets(line, sizeof(line), in); lineno++) {
+    if (line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+    if (sscanf(line, "%*ld %255s %lu %lu", name, &selected, &count) != 3) {
+      warning(0, "variant profile %qs, line %u: not a counters line",
+              flag_kzaw_variant_profile, lineno);
+      continue;
+    }
+    calls->get_or_insert(get_identifier(name)) += count;
+  }
+  fclose(in);
+  return true;
+}
+
+// Heat of a version that got SHARE of the TOTAL hosts or calls of its
+// group, where MOST is the largest share of any version of the group
+static variant_heat
+share_heat(unsigned HOST_WIDE_INT share, unsigned HOST_WIDE_INT most,
+           unsigned HOST_WIDE_INT total)
+{
+  if (share && share == most)
+    return VARIANT_HOT;
+  if (!total || sreal(share) * 100 < sreal(total) * param_kzaw_cold_variant_percent)
+    return VARIANT_COLD;
+  return VARIANT_UNKNOWN;
+}
+
+// Number of hosts that select VERSION according to the counts HOSTS the
+// fleet pass recorded on its group
+static unsigned HOST_WIDE_INT
+fleet_hosts(tree hosts, cgraph_node *version)
+{
+  const char *target = version_target(version->decl);
+  if (!target)
+    return 0;
+  tree suffix = target_suffix(target);
+  for (tree t = hosts; t; t = TREE_CHAIN(t))
+    if (target_suffix(TREE_STRING_POINTER(TREE_PURPOSE(t))) == suffix)
+      return tree_to_uhwi(TREE_VALUE(t));
+  return 0;
+}
+
+// Work out the heat of each version of the group of default version NODE
+// from the fleet's host counts and from CALLS, if given, and merge it into
+// HEAT under the node that holds the version's body.  Bodies are added to
+// BODIES the first time they are seen.
+static void
+group_heat(cgraph_node *node, variant_call_map *calls,
+           hash_map<cgraph_node *, int> &heat, vec<cgraph_node *> &bodies)
+{
+  auto_vec<cgraph_node *> versions;
+  for (cgraph_function_version_info *v = first_version(node); v; v = v->next)
+    if (v->this_node->definition && !v->this_node->dispatcher_function)
+      versions.safe_push(v->this_node);
+
+  tree attr = lookup_attribute(KZAW_FLEET_HOSTS_ATTR, DECL_ATTRIBUTES(node->decl));
+  auto_vec<unsigned HOST_WIDE_INT> hosts, counts;
+  unsigned HOST_WIDE_INT most_hosts = 0, total_hosts = 0;
+  unsigned HOST_WIDE_INT most_calls = 0, total_calls = 0;
+  bool profiled = false;
+  for (unsigned i = 0; i < versions.length(); i++) {
+    hosts.safe_push(attr ? fleet_hosts(TREE_VALUE(attr), versions[i]) : 0);
+    most_hosts = MAX(most_hosts, hosts[i]);
+    total_hosts += hosts[i];
+
+    unsigned HOST_WIDE_INT *count
+      = calls ? calls->get(DECL_ASSEMBLER_NAME(versions[i]->decl)) : NULL;
+    profiled |= count != NULL;
+    counts.safe_push(count ? *count : 0);
+    most_calls = MAX(most_calls, counts[i]);
+    total_calls += counts[i];
+  }
+
+  for (unsigned i = 0; i < versions.length(); i++) {
+    variant_heat by_fleet = attr ? share_heat(hosts[i], most_hosts, total_hosts)
+                                 : VARIANT_UNKNOWN;
+    variant_heat by_profile = profiled ? share_heat(counts[i], most_calls, total_calls)
+                                       : VARIANT_UNKNOWN;
+
+    // Either source knowing the version runs outweighs the other's doubt
+    variant_heat h = (by_fleet == VARIANT_HOT || by_profile == VARIANT_HOT
+                      ? VARIANT_HOT : MIN(by_fleet, by_profile));
+
+    cgraph_node *body = versions[i]->ultimate_alias_target();
+    bool existed;
+    int &merged = heat.get_or_insert(body, &existed);
+    if (!existed) {
+      merged = h;
+      bodies.safe_push(body);
+    } else
+      merged = MAX(merged, (int) h);
+  }
+}
+
+// Put NODE in section SECTION, or in its own subsection of it under
+// -ffunction-sections, unless its section is already fixed.  Returns true
+// if NODE was moved.
+static bool
+place_function(cgraph_node *node, const char *section)
+{
+  if (node->get_section() || node->get_comdat_group())
+    return false;
+
+  if (flag_function_sections) {
+    char *name = concat(section, ".",
+                        IDENTIFIER_POINTER(DECL_ASSEMBLER_NAME(node->decl)), NULL);
+    node->set_section(name);
+    free(name);
+  } else
+    node->set_section(section);
+  node->implicit_section = true;
+
+  if (dump_file) {
+    fprintf(dump_file, "Moving %s to %s\n", node->dump_name(), section);
+  }
+  return true;
+}
+
+unsigned int
+pass_ipa_kzaw_sections::execute(function *)
+{
+  variant_call_map *calls = NULL;
+  if (flag_kzaw_variant_profile) {
+    calls = new variant_call_map;
+    if (!read_variant_profile(calls)) {
+      delete calls;
+      calls = NULL;
+    }
+  }
+
+  cgraph_node *node;
+  hash_map<cgraph_node *, int> heat;
+  auto_vec<cgraph_node *> bodies;
+  unsigned resolvers = 0;
+  FOR_EACH_DEFINED_FUNCTION(node) {
+    if (node->alias || node->thunk || node->inlined_to)
+      continue;
+    if (is_resolver_function(node->decl)) {
+      resolvers += place_function(node, ".text.startup");
+      continue;
+    }
+    if (!node->dispatcher_function && node->function_version()
+        && is_function_default_version(node->decl))
+      group_heat(node, calls, heat, bodies);
+  }
+
+  unsigned hot = 0, cold = 0;
+  for (unsigned i = 0; i < bodies.length(); i++) {
+    int h = *heat.get(bodies[i]);
+    if (h == VARIANT_HOT)
+      hot += place_function(bodies[i], ".text.hot");
+    else if (h == VARIANT_COLD)
+      cold += place_function(bodies[i], ".text.unlikely");
+  }
+
+  if (dump_file) {
+    fprintf(dump_file, "%u of %u version bodies moved to .text.hot, %u to "
+            ".text.unlikely; %u resolvers moved to .text.startup\n",
+            hot, bodies.length(), cold, resolvers);
+  }
+
+  delete calls;
+  return 0;
+}
+
+} // anonymous namespace
+
+// Registration.  Each factory below is declared in tree-pass.h next to
+// make_pass_target_clone, e.g.
+//
+//   extern simple_ipa_opt_pass *make_pass_ipa_kzaw_implied (gcc::context *ctxt);
+//
+// and the passes go into passes.def in this order.  The IPA passes before
+// pass_target_clone edit target_clones attributes, so they must run before
+// it expands them; those after it work on the version chains it builds.
+//
+//   In all_small_ipa_passes, around pass_target_clone:
+//     NEXT_PASS (pass_ipa_kzaw_auto_clone);
+//     NEXT_PASS (pass_ipa_kzaw_implied);
+//     NEXT_PASS (pass_ipa_kzaw_manifest);
+//     NEXT_PASS (pass_ipa_kzaw_predict);
+//     NEXT_PASS (pass_ipa_kzaw_fleet);
+//     NEXT_PASS (pass_ipa_kzaw_budget);
+//     NEXT_PASS (pass_target_clone);
+//     NEXT_PASS (pass_ipa_kzaw_explore);
+//     NEXT_PASS (pass_ipa_kzaw_self_tune);
+//     NEXT_PASS (pass_ipa_kzaw_shared_resolver);
+//     NEXT_PASS (pass_ipa_kzaw_direct_calls);
+//     NEXT_PASS (pass_ipa_kzaw_dedup);
+//     NEXT_PASS (pass_ipa_kzaw_sections);
+//
+//   In all_passes, after pass_nrv and before pass_expand:
+//     NEXT_PASS (pass_kzaw);
+//
+//   In pass_late_compilation, right after pass_machine_reorg:
+//     NEXT_PASS (pass_kzaw_rtl);
+
+// Factory function that creates an instance of the pass
+gimple_opt_pass *
+make_pass_kzaw (gcc::context *ctxt)
+{
+  return new pass_kzaw (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_explore (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_explore (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_auto_clone (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_auto_clone (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_implied (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_implied (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_predict (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_predict (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_direct_calls (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_direct_calls (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_dedup (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_dedup (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_fleet (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_fleet (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_budget (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_budget (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_self_tune (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_self_tune (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_shared_resolver (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_shared_resolver (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_sections (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_sections (ctxt);
+}
+
+simple_ipa_opt_pass *
+make_pass_ipa_kzaw_manifest (gcc::context *ctxt)
+{
+  return new pass_ipa_kzaw_manifest (ctxt);
+}
+
+rtl_opt_pass *
+make_pass_kzaw_rtl (gcc::context *ctxt)
+{
+  return new pass_kzaw_rtl (ctxt);
+}